@@ -3,30 +3,298 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 /*
- * Define libc malloc if not defined by the user.
- * The user should define it using '#define CSV_malloc <usr_malloc>'
+ * Define libc malloc, realloc and free if not defined by the user.
+ * The user should define them using '#define CSV_MALLOC <usr_malloc>'
+ * (and likewise CSV_REALLOC and CSV_FREE). They back the default
+ * allocator; buffers created with csv_create_buffer_alloc use the
+ * allocator they were given instead.
 */
 #ifndef CSV_MALLOC
 #include <stdlib.h>
 #define CSV_MALLOC malloc
 #endif
+#ifndef CSV_REALLOC
+#define CSV_REALLOC realloc
+#endif
+#ifndef CSV_FREE
+#define CSV_FREE free
+#endif
+
+/*
+ * Allocator used for every allocation a buffer makes, including the
+ * CSV_BUFFER itself. ctx is passed back to each function unchanged.
+ */
+typedef struct CSV_ALLOCATOR {
+        void *(*malloc)(void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *ptr, size_t size);
+        void (*free)(void *ctx, void *ptr);
+        void *ctx;
+} CSV_ALLOCATOR;
+
+/*
+ * Field flags. A borrowed field (or its text) lives inside one of the
+ * buffer's storage chunks and must not be passed to free/realloc.
+ */
+#define CSV_FIELD_BORROWED 0x1
+#define CSV_TEXT_BORROWED  0x2
+
+/*
+ * Text of up to CSV_SMALL_TEXT bytes (counting the '\0') is stored
+ * inside the CSV_FIELD itself; field->text then points at small.
+ */
+#ifndef CSV_SMALL_TEXT
+#define CSV_SMALL_TEXT 16
+#endif
 
 typedef struct CSV_FIELD {
         char *text;
         size_t length;
+        unsigned char flags;
+        char small[CSV_SMALL_TEXT];
 } CSV_FIELD;
 
+/*
+ * A block of storage owned by a buffer. Fields and text are carved
+ * out of data[] and released together when the buffer is destroyed.
+ */
+typedef struct CSV_CHUNK {
+        struct CSV_CHUNK *next;
+        size_t size;
+        size_t used;
+        union {
+                void *p;
+                size_t s;
+                double d;
+        } data[];
+} CSV_CHUNK;
+
+/*
+ * Reference counts of storage shared between buffers, see
+ * csv_snapshot. They are atomic when compiled as C11 with atomics;
+ * otherwise they are plain counters, and buffers sharing storage
+ * must not be used from several threads at once (see csv_freeze).
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+    && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_size_t CSV_REFS;
+#define CSV_REF_INIT(r, n) atomic_init(&(r), (n))
+#define CSV_REF_GET(r) atomic_load(&(r))
+#define CSV_REF_INC(r) atomic_fetch_add(&(r), 1)
+#define CSV_REF_DEC(r) (atomic_fetch_sub(&(r), 1) - 1)
+#else
+typedef size_t CSV_REFS;
+#define CSV_REF_INIT(r, n) ((r) = (n))
+#define CSV_REF_GET(r) (r)
+#define CSV_REF_INC(r) ((r)++)
+#define CSV_REF_DEC(r) (--(r))
+#endif
+
+/*
+ * The number of buffers holding a shared row (or a shared flat
+ * layout). Shared storage is never modified; a buffer that wants to
+ * write to it makes its own copy first.
+ */
+typedef struct CSV_SHARE {
+        CSV_REFS refs;
+} CSV_SHARE;
+
+/*
+ * The chunks of a buffer. Fields borrowed from them may be shared
+ * with snapshots, so the store is reference counted, and a snapshot
+ * holds on to the store of the buffer it was taken from via parent.
+ */
+typedef struct CSV_STORE {
+        CSV_REFS refs;
+        CSV_CHUNK *chunks;
+        struct CSV_STORE *parent;
+} CSV_STORE;
+
+/*
+ * Default and largest chunk sizes of an arena buffer. Each new chunk
+ * is twice the size of the last one, up to CSV_ARENA_MAX.
+ */
+#ifndef CSV_ARENA_CHUNK
+#define CSV_ARENA_CHUNK 65536
+#endif
+#ifndef CSV_ARENA_MAX
+#define CSV_ARENA_MAX (16 * 1024 * 1024)
+#endif
+
+/*
+ * Storage layouts, see csv_set_layout.
+ * CSV_LAYOUT_TREE: field[row][entry] points to its own CSV_FIELD.
+ * CSV_LAYOUT_ROWS: compressed-sparse-row grid, read only.
+ * CSV_LAYOUT_COLUMNS: one array of cells per column, read only.
+ */
+#define CSV_LAYOUT_TREE 0
+#define CSV_LAYOUT_ROWS 1
+#define CSV_LAYOUT_COLUMNS 2
+
+/*
+ * A cell of a flat grid: text + offset is the '\0' terminated
+ * text, length counts the '\0' just like CSV_FIELD.length.
+ */
+typedef struct CSV_CELL {
+        size_t offset;
+        size_t length;
+} CSV_CELL;
+
+/*
+ * Compressed-sparse-row grid. The cells of row i are
+ * cell[start[i]] .. cell[start[i+1] - 1]. The grid, its arrays and
+ * its text are a single allocation.
+ */
+typedef struct CSV_GRID {
+        CSV_CELL *cell;
+        size_t *start;
+        char *text;
+} CSV_GRID;
+
+/*
+ * A column of a columnar buffer. cell[i] is the cell of row i
+ * (meaningless if row i is narrower than the column) and its text
+ * lives in the column's own text heap.
+ *
+ * A dictionary encoded column stores every distinct value once:
+ * cell[] then has one entry per value and code[i] is the index of
+ * row i's value (CSV_NO_CODE if the row is too narrow). Cells, codes
+ * and text are a single allocation.
+ */
+typedef struct CSV_COLUMN {
+        CSV_CELL *cell;
+        uint32_t *code;
+        size_t distinct;
+        char *text;
+} CSV_COLUMN;
+
+#define CSV_NO_CODE UINT32_MAX
+
+/*
+ * A column is dictionary encoded when converted to CSV_LAYOUT_COLUMNS
+ * if it has at most one distinct value per CSV_DICT_RATIO rows (rows
+ * too narrow for the column count too, as an unencoded column keeps
+ * a cell for them).
+ * Define it as 0 to never encode.
+ */
+#ifndef CSV_DICT_RATIO
+#define CSV_DICT_RATIO 2
+#endif
+
+/*
+ * csv_transpose works on square tiles of this many rows and columns
+ * of the source, so that the rows of the result being filled stay in
+ * cache.
+ */
+#ifndef CSV_TRANSPOSE_BLOCK
+#define CSV_TRANSPOSE_BLOCK 64
+#endif
+
+/*
+ * Size of the output block csv_save formats into; the file is
+ * written one full block at a time.
+ */
+#ifndef CSV_SAVE_BLOCK
+#define CSV_SAVE_BLOCK (256 * 1024)
+#endif
+
+/*
+ * A row the buffer let go of during a transaction, which must live
+ * on until csv_commit in case of csv_rollback. share is set if the
+ * row was shared after csv_begin, and counts the transaction as one
+ * of its holders.
+ */
+typedef struct CSV_UNDO {
+        CSV_FIELD **row;
+        size_t width;
+        CSV_SHARE *share;
+} CSV_UNDO;
+
+/*
+ * The state of a buffer at csv_begin. The transaction holds on to
+ * every row, store and all: rows that were shared already count it
+ * as one more holder, and rows that were not get mark as their share
+ * count (two holders, the buffer and the transaction), so the buffer
+ * copies them before writing. log has room for every marked row.
+ */
+typedef struct CSV_TXN {
+        CSV_SHARE mark;
+        size_t rows;
+        CSV_FIELD ***field;
+        size_t *width;
+        size_t *row_capacity;
+        CSV_SHARE **share;
+        CSV_STORE *store;
+        CSV_UNDO *log;
+        size_t logged;
+        int layout; /* the layout at csv_begin */
+} CSV_TXN;
+
 typedef struct CSV_BUFFER {
         CSV_FIELD ***field;
         size_t rows;
         size_t *width; 
+        size_t capacity; /* rows allocated in width (and field) */
+        size_t *row_capacity; /* fields allocated in each row */
         char field_delim;
         char text_delim;
+        CSV_STORE *store;
+        size_t arena; /* size of the next arena chunk, 0 if not an arena */
+        CSV_ALLOCATOR alloc;
+        CSV_GRID *grid; /* set (and field NULL) in CSV_LAYOUT_ROWS */
+        CSV_COLUMN *column; /* set (and field NULL) in CSV_LAYOUT_COLUMNS */
+        size_t columns;
+        CSV_SHARE **share; /* per row, NULL if the row is not shared */
+        CSV_SHARE *layout_share; /* set if grid or column is shared */
+        CSV_REFS refs; /* see csv_retain */
+        int frozen; /* see csv_freeze */
+        CSV_TXN *txn; /* see csv_begin */
 } CSV_BUFFER;
 
-#define CSV_ENTRY(buf, i, j) ((buf)->field[(i)][(j)]->text)
+/*
+ * Memory used by a buffer, in bytes, see csv_memory_stats. Each
+ * component counts only the bytes in use; room allocated but not
+ * (or no longer) used is counted in slack instead.
+ */
+typedef struct CSV_STATS {
+        size_t text; /* cell text outside the CSV_FIELDs, '\0's included */
+        size_t fields; /* CSV_FIELD headers, with their inline text */
+        size_t cells; /* CSV_CELLs, codes and row starts of a flat layout */
+        size_t rows; /* the row table and the row pointer arrays */
+        size_t width; /* the width and row_capacity arrays */
+        size_t overhead; /* the CSV_BUFFER, chunk headers and counts */
+        size_t slack; /* spare capacity and unused chunk space */
+        size_t total; /* all of the above */
+        size_t shared; /* part of total shared with other buffers */
+        size_t allocations; /* blocks allocated through the allocator */
+} CSV_STATS;
+
+/*
+ * A piece of text that need not be '\0' terminated, see
+ * csv_append_row.
+ */
+typedef struct CSV_VIEW {
+        const char *text;
+        size_t length;
+} CSV_VIEW;
+
+/*
+ * The output block of csv_save. error is set once a write fails.
+ */
+typedef struct CSV_WRITER {
+        FILE *fp;
+        char *data;
+        size_t size;
+        size_t used;
+        int error;
+} CSV_WRITER;
+
+#define CSV_ENTRY(buf, i, j) ((buf)->field != NULL \
+        ? (buf)->field[(i)][(j)]->text : csv_entry((buf), (i), (j)))
 #define CSV_ROWS(buf) (buf)->rows
 #define CSV_COLS(buf, j) (buf)->width[(j)]
 
@@ -41,16 +309,17 @@ typedef struct CSV_BUFFER {
  * 0: success
  * 1: realloc failure
  */
-static int add_char(char **string, int *c, char ch);
+static int add_char(CSV_BUFFER *buffer, char **string, int *c, char ch);
 
 /* Function: create_field 
  * ------------------------
  * Should be called once on every CSV_FIELD used. Allocates
- * memory for the field. Length is set to 0 and text to NULL
+ * memory for the field (from the arena if the buffer is one).
+ * The field is set to the empty string.
  * 
  * Returns NULL on error via malloc.
  */
-static CSV_FIELD *create_field();
+static CSV_FIELD *create_field(CSV_BUFFER *buffer);
 
 /* Function: destroy_field
  * ---------------------------
@@ -62,555 +331,3010 @@ static CSV_FIELD *create_field();
  * 0: success
  * 1: error realloc'ing field's char array
  */
-static void destroy_field(CSV_FIELD *field);
+static void destroy_field(CSV_BUFFER *buffer, CSV_FIELD *field);
 
 /* Function: set_field
  * -----------------------
  * Sets a field text to the string provided. Adjusts field
- * length accordingly. 
+ * length accordingly. Short text is kept inside the field.
+ * Otherwise, in an arena buffer the text is taken from the
+ * arena; the old text is only reclaimed when the buffer is
+ * destroyed.
  * 
  * Returns:
  *  0: success
  *  1: error allocating space to the string
  */
-static int set_field(CSV_FIELD *field, char *text);
-
-/* Function: csv_create_buffer
- * ---------------------------
- * Must be called before any declared buffer is used. 
- * Allocates memory for the buffer.
- * Sets the number of rows to 0
- * Sets Text Delim to '"' and field delim to ',' by default.
- */
-CSV_BUFFER *csv_create_buffer();
-
-/* Function: csv_destroy_buffer
- * ----------------------------
- * Frees memory allocated by csv_create_buffer and any fields
- * that are part of the buffer.
- */
-void csv_destroy_buffer(CSV_BUFFER *buffer);
+static int set_field(CSV_BUFFER *buffer, CSV_FIELD *field, char *text);
 
-/* Function: append_row
- * -------------------------------
- * Adds a "row" to the end of a CSV_BUFFER. The row is 
- * initialized with no fields. Also adds an integer to the
- * width array and sets width = 0.
+/* Function: set_field_n
+ * -----------------------
+ * Same as set_field, but copies exactly length bytes of text (which
+ * need not be '\0' terminated and may contain '\0's) and terminates
+ * them.
  *
  * Returns:
- * 0: success
- * 1: error allocating width memory
- * 2: error allocating field memory
+ *  0: success
+ *  1: error allocating space to the string
  */
-static int append_row(CSV_BUFFER *buffer);
+static int set_field_n(CSV_BUFFER *buffer, CSV_FIELD *field,
+                const char *text, size_t length);
 
-/* Function: append_field
- * ---------------------------------
- * Adds a field to the end of a given row in a CSV_BUFFER. 
- * The field is initialized using csv_create_buffer.
+/* Function: adopt_text
+ * -----------------------
+ * Makes data, length bytes allocated with the buffer's allocator
+ * and room for a '\0' after them, the text of a field. Short text
+ * and the text of an arena buffer are copied and data is freed.
  *
  * Returns:
- * 0: success
- * 1: the given row does not extist
- * 2: memory allocation error 
- */
-static int append_field(CSV_BUFFER *buffer, size_t row);
-
-/* Function: remove_last_field
- * -------------------------------
- * Removes the field at the end of a given row.
- * 
- * Returns:
  *  0: success
- *  1: the requested row is already empty
- *  2: the requested row does not exist
+ *  1: error allocating space to the string (data is freed)
  */
-static int remove_last_field(CSV_BUFFER *buffer, size_t row);
+static int adopt_text(CSV_BUFFER *buffer, CSV_FIELD *field,
+                char *data, size_t length);
 
-/* Function: remove_last_row
- * -----------------------------
- * Removes the final row of the buffer.
+/* Function: field_at
+ * -----------------------
+ * Finds the field at row, entry for writing, first adding rows and
+ * fields as needed (with geometric growth) and making sure the row
+ * is not shared.
  *
- * Returns:
- *  0: success
+ * Returns NULL on error via malloc, or if the buffer is frozen.
  */
-static int remove_last_row(CSV_BUFFER *buffer);
+static CSV_FIELD *field_at(CSV_BUFFER *buffer, size_t row, size_t entry);
 
-/* Function: read_next_field
- * -----------------------------
- * Moves the file pointer to the beginning of the next 
- * entry. If not NULL, the length and text are copied to the
- * field provided.
- *
- * Note that consecutive field delimenators indicate empty
- * cells and lines ending with a delimenator (before the
- * new line characte)  are interpreted as having a trailing 
- * empty cell. 
+/* Function: cell_text
+ * -----------------------
+ * Looks up an existing cell in whatever layout the buffer uses.
+ * If length is not NULL it is set to the length of the text
+ * including the '\0'.
  *
- * Text-deliminated cells may contain text deliminator, field
- * deliminator, and newline characers. Characters between the
- * end of a text deliminaton and the field deliminator (or
- * newline or EOF) are ignored. 
+ * Returns the text of the cell.
+ */
+static char *cell_text(CSV_BUFFER *buffer, size_t row, size_t entry,
+                size_t *length);
+
+/* Function: alloc_rows
+ * -----------------------
+ * Allocates a row table (and its row_capacity array) with room for
+ * capacity rows and one exactly sized pointer array for each of the
+ * rows described by width.
  *
- * Returns: 
- *  0: Moved successfully to the next entry in this row  
- *  1: The next entry is on a new row 
- *  2: There is no next entry (EOF)
+ * Returns NULL on error via malloc (nothing is left allocated).
  */
-static int read_next_field(FILE *fp,
-                char field_delim, char text_delim, 
-                CSV_FIELD *field);
+static CSV_FIELD ***alloc_rows(CSV_BUFFER *buffer, size_t rows,
+                size_t capacity, const size_t *width, size_t **row_capacity);
 
-/* Function: csv_load
+/* Function: grow_rows
  * -----------------------
- * Loads the given file into the buffer.
+ * Makes room for at least capacity rows in the width, field and
+ * row_capacity arrays.
  *
  * Returns:
  *  0: success
- *  1: file not found
- *  2: failure to resize buffer (memory failure)
+ *  1: memory allocation failure
  */
-int csv_load(CSV_BUFFER *buffer, char *file_name);
+static int grow_rows(CSV_BUFFER *buffer, size_t capacity);
 
-/* Function: csv_save
+/* Function: grow_row
  * -----------------------
- * Saves the csv buffer to a given file. If the file already
- * exists, it is overwritten.
+ * Makes room for at least capacity fields in the given row.
  *
  * Returns:
  *  0: success
- *  1: unable to write to file (invalid name or inufficient
- *     access)
+ *  1: memory allocation failure
  */
-int csv_save(char *file_name, CSV_BUFFER *buffer);
+static int grow_row(CSV_BUFFER *buffer, size_t row, size_t capacity);
 
-/* Function: csv_copy_row
- * ----------------------
- * Deep copy of a row of a CSV_BUFFER. Destination row may
- * be in the same buffer as source. Adjusts the length of 
- * the row.
+/* Function: destroy_row
+ * -----------------------
+ * Destroys the first width fields of a row array (unless they live
+ * in an arena) and frees the array.
+ */
+static void destroy_row(CSV_BUFFER *buffer, CSV_FIELD **row, size_t width);
+
+/* Function: release_row
+ * -----------------------
+ * Lets go of a row of the buffer: a shared row is only destroyed by
+ * the last buffer holding it.
+ */
+static void release_row(CSV_BUFFER *buffer, size_t row);
+
+/* Function: own_row
+ * -----------------------
+ * Makes sure the buffer is the only one holding a row before it is
+ * modified, copying the row if it is still shared. Every function
+ * that modifies the fields of a row calls this first.
  *
  * Returns:
  *  0: success
- *  1: the requested src row does not exist
+ *  1: memory allocation failure (the row is unchanged)
  */
-int csv_copy_row(CSV_BUFFER *dest, size_t dest_row,
-                        CSV_BUFFER *src, size_t src_row);
+static int own_row(CSV_BUFFER *buffer, size_t row);
 
-/* Function: copy_field
- * ------------------------
- * 
- * Copies a given field from one buffer to another (note, source and
- * dest buffers MAY be the same.
- * 
- * Returns:
- *  0: success
- *  1: memory error (see set_field)
+/* Function: share_row
+ * -----------------------
+ * Adds a holder to a row of the buffer, giving it a share count
+ * first if it has none.
+ *
+ * Returns the row's share count, or NULL on error via malloc.
  */
-int csv_copy_field(CSV_BUFFER *dest, int dest_row, int dest_entry,
-                   CSV_BUFFER *source, int source_row, int source_entry);
+static CSV_SHARE *share_row(CSV_BUFFER *buffer, size_t row);
 
+/* Function: move_rows
+ * -----------------------
+ * Moves the row pointers, widths, capacities and share counts of
+ * count rows starting at from so that they start at to. The arrays
+ * must have room for them; nothing is allocated or freed, and the
+ * entries left behind are stale.
+ */
+static void move_rows(CSV_BUFFER *buffer, size_t to, size_t from, size_t count);
 
-/* Function: csv_get_field
- * ----------------------------------
- * Copies an entry from a CSV_BUFFER to a string provided.
- * The caller is expected to provide the string's length.
- * If the requested cell does not exist, or is empty, the
- * string is filled with null characters.
- *
- * Returns:
- *  0: the whole entry was copied
- *  1: the entry was trucated to fit the string
- *  2: the request cell was empty (or does not exist)
- *  3: the length given was 0
+/* Function: release_store
+ * -----------------------
+ * Drops a reference to a store, freeing its chunks (and releasing
+ * its parent) if it was the last one.
  */
-int csv_get_field(char *dest, size_t dest_len, 
-        CSV_BUFFER *src, size_t row, size_t entry);
+static void release_store(CSV_BUFFER *buffer, CSV_STORE *store);
 
-/* Function: csv_clear_field
- * -------------------------
- * 
- * If the field is the last in the row (and not the first), it is
- * removed (the width of the row is decremented by one). Otherwise,
- * it is just cleared, and a spacer remains.
+/* Function: free_tree
+ * -----------------------
+ * Releases every field, row array and chunk of a buffer in
+ * CSV_LAYOUT_TREE, leaving the row count and widths untouched.
+ */
+static void free_tree(CSV_BUFFER *buffer);
+
+/* Function: free_layout
+ * -----------------------
+ * Releases the cells of a buffer in any layout, leaving the row
+ * count and widths untouched.
+ */
+static void free_layout(CSV_BUFFER *buffer);
+
+/* Function: to_tree
+ * -----------------------
+ * Converts the buffer back to CSV_LAYOUT_TREE, if needed. Every
+ * function that modifies a buffer calls this first. The fields
+ * are rebuilt in a single exactly sized chunk.
  *
  * Returns:
  *  0: success
- *  TODO errors
+ *  1: memory allocation failure, or the buffer is frozen (the
+ *     buffer is unchanged)
  */
-int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry);
+static int to_tree(CSV_BUFFER *buffer);
 
-/* Function: csv_clear_row
+/* Function: to_rows
  * -----------------------
- * 
- * Destroys all but one field in the row, and clears that field.
- * Row size is now 1.
+ * Converts a buffer in any other layout to CSV_LAYOUT_ROWS.
  *
  * Returns:
  *  0: success
- *  1: memory allocation falirure (note this function only 
- *      reduces memory used, so reallocation should never fail)
+ *  1: memory allocation failure (the buffer is unchanged)
  */
-int csv_clear_row(CSV_BUFFER *buffer, size_t row);
+static int to_rows(CSV_BUFFER *buffer);
 
-/* Function: csv_remove_row
- * ------------------------
- * 
- * Completely removes a row from the buffer such that it's two
- * neighboring rows are now adjacent and buffer height is reduced
- * by one.
+/* Function: to_columns
+ * -----------------------
+ * Converts a buffer in any other layout to CSV_LAYOUT_COLUMNS.
  *
  * Returns:
  *  0: success
- *  1: memory allocation falirure (note this function only 
- *      reduces memory used, so reallocation should never fail)
+ *  1: memory allocation failure (the buffer is unchanged)
  */
-int csv_remove_row(CSV_BUFFER *buffer, size_t row);
+static int to_columns(CSV_BUFFER *buffer);
 
-/* Function: csv_remove_col
- * ------------------------
- * 
- * Completely removes a col from the buffer such that it's two
- * neighboring cols are now adjacent and buffer height is reduced
- * by one.
+/* Function: place_text
+ * -----------------------
+ * Points a field carved from a chunk at text that has been copied
+ * to *dest. Short text is moved into the field and *dest is left
+ * alone, longer text stays where it is and *dest is advanced past
+ * it. Chunks are sized with CSV_SMALL_TEXT bytes of slack so the
+ * last short text always has room at *dest.
+ */
+static void place_text(CSV_FIELD *cell, char **dest, size_t length);
+
+/* Function: hash_text
+ * -----------------------
+ * FNV-1a hash of length bytes of text.
+ */
+static uint32_t hash_text(const char *text, size_t length);
+
+/* Function: build_column
+ * -----------------------
+ * Builds column j of the columnar layout from the buffer's current
+ * layout, dictionary encoding it if it has few enough distinct
+ * values (see CSV_DICT_RATIO).
  *
  * Returns:
  *  0: success
- *  1: memory allocation falirure (note this function only 
- *      reduces memory used, so reallocation should never fail)
+ *  1: memory allocation failure
  */
- int csv_remove_col(CSV_BUFFER *buffer, size_t col);
+static int build_column(CSV_BUFFER *buffer, size_t j, CSV_COLUMN *column);
 
-void csv_set_text_delim(CSV_BUFFER *buffer, char new_delim);
-
-void csv_set_field_delim(CSV_BUFFER *buffer, char new_delim);
+/* Function: arena_alloc
+ * -----------------------
+ * Bump-allocates size bytes aligned to align from the buffer's
+ * newest chunk, adding a chunk when it is full.
+ *
+ * Returns NULL on error via malloc.
+ */
+static void *arena_alloc(CSV_BUFFER *buffer, size_t size, size_t align);
 
-int csv_get_height(CSV_BUFFER *buffer);
+/* Function: csv_create_buffer
+ * ---------------------------
+ * Must be called before any declared buffer is used. 
+ * Allocates memory for the buffer.
+ * Sets the number of rows to 0
+ * Sets Text Delim to '"' and field delim to ',' by default.
+ */
+CSV_BUFFER *csv_create_buffer();
+
+/* Function: csv_create_buffer_alloc
+ * ---------------------------
+ * Same as csv_create_buffer, but the buffer (and everything it ever
+ * allocates) lives in memory from the given allocator, which is
+ * copied into the buffer.
+ *
+ * Returns NULL on error via the allocator.
+ */
+CSV_BUFFER *csv_create_buffer_alloc(const CSV_ALLOCATOR *allocator);
+
+/* Function: buf_malloc, buf_realloc, buf_free
+ * ---------------------------
+ * Allocate and release memory through the buffer's allocator.
+ */
+static void *buf_malloc(CSV_BUFFER *buffer, size_t size);
+static void *buf_realloc(CSV_BUFFER *buffer, void *ptr, size_t size);
+static void buf_free(CSV_BUFFER *buffer, void *ptr);
+
+/* Function: csv_destroy_buffer
+ * ----------------------------
+ * Frees memory allocated by csv_create_buffer and any fields
+ * that are part of the buffer. The fields of an arena buffer
+ * are released with its chunks rather than one by one.
+ *
+ * If the buffer has been retained, this only drops one reference
+ * and the buffer is freed along with the last one.
+ */
+void csv_destroy_buffer(CSV_BUFFER *buffer);
+
+/* Function: csv_retain
+ * ----------------------------
+ * Adds a reference to the buffer; each reference is dropped with
+ * csv_destroy_buffer. This lets several owners (typically threads
+ * sharing a frozen buffer) release it independently.
+ *
+ * Returns the buffer.
+ */
+CSV_BUFFER *csv_retain(CSV_BUFFER *buffer);
+
+/* Function: csv_freeze
+ * ----------------------------
+ * Makes the buffer permanently read only. The buffer is compacted
+ * into CSV_LAYOUT_ROWS, one exactly sized block of cells and text.
+ *
+ * Nothing in a frozen buffer is ever written again, so any number
+ * of threads may read it at the same time without locking:
+ * csv_get_field, csv_get_width, csv_get_height,
+ * csv_get_field_length, csv_entry (and CSV_ENTRY), csv_save and
+ * csv_snapshot are all safe, as are csv_retain and
+ * csv_destroy_buffer. Every function that would modify a frozen
+ * buffer fails with the error it returns for a memory allocation
+ * failure, and the delimiter setters do nothing.
+ *
+ * csv_snapshot, csv_retain and csv_destroy_buffer update reference
+ * counts, which are only atomic when compiled as C11 with
+ * <stdatomic.h> (__STDC_NO_ATOMICS__ not defined). Without it those
+ * three calls need a lock around them.
+ *
+ * A buffer cannot be frozen while a transaction is open.
+ *
+ * Snapshots of a frozen buffer are ordinary, writable buffers that
+ * share its storage.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or a transaction is open (the
+ *     buffer is unchanged)
+ */
+int csv_freeze(CSV_BUFFER *buffer);
+
+/* Function: csv_memory_stats
+ * ----------------------------
+ * Fills stats with the memory used by the buffer, broken down by
+ * component, in whatever layout it is in. Storage shared with
+ * snapshots is counted in full by every buffer using it and also
+ * reported in stats->shared. The chunk slack of a snapshot is an
+ * estimate, as some of its fields live in its parent's chunks.
+ * During a transaction, the rows kept only for csv_rollback are not
+ * counted.
+ */
+void csv_memory_stats(CSV_BUFFER *buffer, CSV_STATS *stats);
+
+/* Function: csv_compact
+ * ----------------------------
+ * Rebuilds the buffer into tightly packed storage in its current
+ * layout: a tree is rebuilt into a single exactly sized chunk,
+ * every array is trimmed to size and trailing empty cells are
+ * dropped from each row (a row keeps at least one cell). Rows
+ * shared with snapshots are copied out in the process.
+ *
+ * If reclaimed is not NULL it is set to the number of bytes freed
+ * (see csv_memory_stats).
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen (on an
+ *     allocation failure the buffer keeps its contents but may be
+ *     left in CSV_LAYOUT_ROWS)
+ */
+int csv_compact(CSV_BUFFER *buffer, size_t *reclaimed);
+
+/* Function: csv_snapshot
+ * ----------------------------
+ * Creates a buffer holding the same rows as the given one. The two
+ * buffers are independent, but share the storage of every row until
+ * one of them modifies it, at which point only that row is copied.
+ * Taking a snapshot costs O(rows) and no text is copied. A buffer in
+ * one of the flat layouts shares the whole layout instead, until
+ * either side converts it back to CSV_LAYOUT_TREE.
+ *
+ * The snapshot uses the allocator, delimiters and arena mode of the
+ * buffer, and either of them may be destroyed first.
+ *
+ * Returns NULL on error via malloc.
+ */
+CSV_BUFFER *csv_snapshot(CSV_BUFFER *buffer);
+
+/* Function: csv_begin
+ * ----------------------------
+ * Opens a transaction: every change made to the buffer from now on
+ * can be undone with csv_rollback, or kept with csv_commit.
+ *
+ * Nothing is copied up front. The transaction holds on to the rows
+ * as a snapshot does, so a row is only copied when it is first
+ * modified, and a row that is removed is only set aside. Opening a
+ * transaction costs O(rows) and converts a buffer in one of the flat
+ * layouts to CSV_LAYOUT_TREE (csv_rollback converts it back).
+ *
+ * While a transaction is open csv_freeze and csv_use_arena fail.
+ * Destroying the buffer discards the transaction.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ *  2: a transaction is already open
+ */
+int csv_begin(CSV_BUFFER *buffer);
+
+/* Function: csv_commit
+ * ----------------------------
+ * Closes the transaction, keeping every change made since
+ * csv_begin, and frees the rows that were set aside.
+ *
+ * Returns:
+ *  0: success
+ *  2: no transaction is open
+ */
+int csv_commit(CSV_BUFFER *buffer);
+
+/* Function: csv_rollback
+ * ----------------------------
+ * Closes the transaction, returning the buffer to the rows, widths
+ * and layout it had at csv_begin. Delimiters are not restored.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure while converting the buffer back to
+ *     a flat layout (the rows are restored, in CSV_LAYOUT_TREE)
+ *  2: no transaction is open
+ */
+int csv_rollback(CSV_BUFFER *buffer);
+
+/* Function: txn_row
+ * ----------------------------
+ * Returns: true if a row is held by the buffer and by its open
+ * transaction, and by nothing else
+ */
+static bool txn_row(CSV_BUFFER *buffer, size_t row);
+
+/* Function: find_undo
+ * ----------------------------
+ * Orders undo records by row, for qsort and bsearch.
+ */
+static int find_undo(const void *a, const void *b);
+
+/* Function: csv_reserve_rows
+ * ---------------------------
+ * Makes room for at least rows rows so that the buffer can grow to
+ * that height without reallocating its row arrays.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure
+ */
+int csv_reserve_rows(CSV_BUFFER *buffer, size_t rows);
+
+/* Function: csv_reserve_fields
+ * ---------------------------
+ * Makes room for at least fields fields in an existing row so that
+ * it can grow to that width without being reallocated.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure
+ *  2: the row does not exist
+ */
+int csv_reserve_fields(CSV_BUFFER *buffer, size_t row, size_t fields);
+
+/* Function: csv_use_arena
+ * ---------------------------
+ * Turns an empty buffer into an arena buffer: every CSV_FIELD and
+ * its text are bump-allocated from large chunks owned by the buffer
+ * instead of being malloc'd one at a time. Text that is overwritten
+ * is not reused until the buffer is destroyed, so arenas suit
+ * buffers that are loaded (or built) and then mostly read.
+ *
+ * chunk_size is the size of the first chunk (0 for CSV_ARENA_CHUNK).
+ *
+ * Returns:
+ *  0: success
+ *  1: the buffer is not empty
+ */
+int csv_use_arena(CSV_BUFFER *buffer, size_t chunk_size);
+
+/* Function: append_row
+ * -------------------------------
+ * Adds a "row" to the end of a CSV_BUFFER. The row is 
+ * initialized with one empty field. The row arrays grow
+ * geometrically, so appending n rows costs O(log n) reallocs.
+ *
+ * Returns:
+ * 0: success
+ * 1: error allocating width memory
+ * 2: error allocating field memory
+ */
+static int append_row(CSV_BUFFER *buffer);
+
+/* Function: append_field
+ * ---------------------------------
+ * Adds a field to the end of a given row in a CSV_BUFFER. 
+ * The field is initialized using create_field. The row grows
+ * geometrically.
+ *
+ * Returns:
+ * 0: success
+ * 1: the given row does not extist
+ * 2: memory allocation error 
+ */
+static int append_field(CSV_BUFFER *buffer, size_t row);
+
+/* Function: remove_last_field
+ * -------------------------------
+ * Removes the field at the end of a given row. The row keeps
+ * its capacity.
+ * 
+ * Returns:
+ *  0: success
+ *  1: the requested row is already empty
+ *  2: the requested row does not exist
+ */
+static int remove_last_field(CSV_BUFFER *buffer, size_t row);
+
+/* Function: remove_last_row
+ * -----------------------------
+ * Removes the final row of the buffer, destroying its fields.
+ *
+ * Returns:
+ *  0: success
+ */
+static int remove_last_row(CSV_BUFFER *buffer);
+
+/* Function: read_next_field
+ * -----------------------------
+ * Moves the file pointer to the beginning of the next 
+ * entry. If not NULL, the length and text are copied to the
+ * field provided.
+ *
+ * Note that consecutive field delimenators indicate empty
+ * cells and lines ending with a delimenator (before the
+ * new line characte)  are interpreted as having a trailing 
+ * empty cell. 
+ *
+ * Text-deliminated cells may contain text deliminator, field
+ * deliminator, and newline characers. Characters between the
+ * end of a text deliminaton and the field deliminator (or
+ * newline or EOF) are ignored. 
+ *
+ * Returns: 
+ *  0: Moved successfully to the next entry in this row  
+ *  1: The next entry is on a new row 
+ *  2: There is no next entry (EOF)
+ */
+static int read_next_field(FILE *fp, CSV_BUFFER *buffer,
+                CSV_FIELD *field);
+
+/* Function: scan_field
+ * -----------------------------
+ * Same parsing rules and return values as read_next_field, but
+ * the decoded text is written straight into dest (at most room - 1
+ * characters plus a '\0'). If dest is NULL the field is only
+ * measured. The decoded length (without '\0') is stored in length.
+ *
+ * Returns: 
+ *  0: Moved successfully to the next entry in this row  
+ *  1: The next entry is on a new row 
+ *  2: There is no next entry (EOF)
+ */
+static int scan_field(FILE *fp,
+                char field_delim, char text_delim,
+                char *dest, size_t room, size_t *length);
+
+/* Function: add_chunk
+ * -----------------------------
+ * Allocates a storage chunk with room for size bytes and links it
+ * into the buffer's chunk list.
+ *
+ * Returns NULL on error via malloc.
+ */
+static CSV_CHUNK *add_chunk(CSV_BUFFER *buffer, size_t size);
+
+/* Function: csv_set_layout
+ * ---------------------------
+ * Converts the buffer to the given layout.
+ *
+ * CSV_LAYOUT_ROWS packs the buffer into one contiguous array of
+ * {offset, length} cells, a row start array and one text block, so
+ * scanning a row reads memory sequentially. Every accessor and
+ * CSV_ENTRY work on it. Functions that modify the buffer convert it
+ * back to CSV_LAYOUT_TREE first, so the flat layouts are best used
+ * once a buffer has been loaded or built.
+ *
+ * CSV_LAYOUT_COLUMNS stores each column as its own array of cells
+ * with its own text heap, so a scan down one column (csv_get_field
+ * with a fixed entry) only touches that column's memory. Columns
+ * with few distinct values are dictionary encoded, see csv_get_code.
+ *
+ * Loading a file keeps the layout the buffer had before the load.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure (the buffer is unchanged)
+ *  2: unknown layout
+ */
+int csv_set_layout(CSV_BUFFER *buffer, int layout);
+
+/* Function: csv_entry
+ * ---------------------------
+ * The text of an existing cell, in any layout. This is what
+ * CSV_ENTRY uses when the buffer is not a tree. The text must not
+ * be modified.
+ */
+char *csv_entry(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+/* Function: csv_get_code
+ * ---------------------------
+ * The dictionary code of a cell of a dictionary encoded column.
+ * Two cells of the same column hold equal text exactly when their
+ * codes are equal, and codes run from 0 to csv_get_distinct - 1, so
+ * filters and group-bys can work on codes instead of strings.
+ *
+ * Returns: the code, or CSV_NO_CODE if the buffer is not in
+ *  CSV_LAYOUT_COLUMNS, the column is not encoded or the cell does
+ *  not exist
+ */
+uint32_t csv_get_code(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+/* Function: csv_find_code
+ * ---------------------------
+ * Looks a value up in the dictionary of a column.
+ *
+ * Returns: the code of text in the column, or CSV_NO_CODE if the
+ *  column is not encoded or never holds that text
+ */
+uint32_t csv_find_code(CSV_BUFFER *buffer, size_t entry, const char *text);
+
+/* Function: csv_get_distinct
+ * ---------------------------
+ * Returns: the number of values in the dictionary of a column, or
+ *  0 if the column is not dictionary encoded
+ */
+size_t csv_get_distinct(CSV_BUFFER *buffer, size_t entry);
+
+/* Function: csv_get_layout
+ * ---------------------------
+ * Returns: the layout the buffer currently uses
+ */
+int csv_get_layout(CSV_BUFFER *buffer);
+
+/* Function: csv_append_row
+ * -----------------------
+ * Adds a row made of the n given cells to the end of the buffer (a
+ * row with no cells gets one empty cell). In an arena buffer the row
+ * costs its pointer array plus one block from the arena holding
+ * every CSV_FIELD and its text, released with the arena. Otherwise
+ * each cell is allocated on its own (with its text, unless that is
+ * short enough to go inline), so removing the row frees it.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ */
+int csv_append_row(CSV_BUFFER *buffer, const CSV_VIEW *fields, size_t n);
+
+/* Function: pack_row
+ * -----------------------
+ * Builds the row array of a row made of the n given cells (one
+ * empty cell if n is 0). In an arena buffer every CSV_FIELD and its
+ * text go in one block from arena_alloc. See csv_append_row.
+ *
+ * Returns NULL on error via malloc.
+ */
+static CSV_FIELD **pack_row(CSV_BUFFER *buffer, const CSV_VIEW *fields,
+                size_t n);
+
+/* Function: csv_insert_rows
+ * -----------------------
+ * Inserts count rows of src, starting at src_first, into the buffer
+ * so that the first of them becomes row at (empty rows are added
+ * if the buffer is not that tall). The gap is opened once, by
+ * moving row pointers. src may be the buffer itself.
+ *
+ * The inserted rows are shared with src, copy-on-write as with
+ * csv_snapshot, when that is safe: within one buffer, or between
+ * tree buffers that use the same allocator, are not arenas and whose
+ * row is not borrowed from src's chunks. Other rows are copied as
+ * csv_append_row builds them.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen (no row
+ *     is inserted, but empty rows may have been added)
+ *  2: src does not have the requested rows
+ */
+int csv_insert_rows(CSV_BUFFER *buffer, size_t at,
+                CSV_BUFFER *src, size_t src_first, size_t count);
+
+/* Function: csv_splice
+ * -----------------------
+ * Inserts all the rows of src into dest so that the first of them
+ * becomes row at, as csv_insert_rows does.
+ *
+ * If take_ownership is true src is consumed: it is left empty (it
+ * must still be destroyed). When both are tree buffers using the
+ * same allocator, and dest is not an arena unless src is one too,
+ * the row arrays and src's chunks are handed over to dest as they
+ * are, so nothing is copied. take_ownership is ignored if src is
+ * dest.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or dest is frozen, or src is
+ *     frozen and take_ownership is true (no row is inserted, but
+ *     empty rows may have been added)
+ */
+int csv_splice(CSV_BUFFER *dest, size_t at, CSV_BUFFER *src,
+                bool take_ownership);
+
+/* Function: csv_append_buffer
+ * -----------------------
+ * Appends all the rows of src to dest, as csv_splice does.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or a buffer is frozen
+ */
+int csv_append_buffer(CSV_BUFFER *dest, CSV_BUFFER *src,
+                bool take_ownership);
+
+/* Function: merge_store
+ * -----------------------
+ * Hands the chunks of src over to dest, so that fields borrowed
+ * from them can move to dest with their rows.
+ *
+ * Returns: false if the chunks cannot change hands, because src's
+ * store is shared with or keeps alive another buffer's chunks.
+ * Nothing is done unless commit is true.
+ */
+static bool merge_store(CSV_BUFFER *dest, CSV_BUFFER *src, bool commit);
+
+/* Function: csv_load
+ * -----------------------
+ * Loads the given file into the buffer.
+ *
+ * Returns:
+ *  0: success
+ *  1: file not found
+ *  2: failure to resize buffer (memory failure)
+ */
+int csv_load(CSV_BUFFER *buffer, char *file_name);
+
+/* Function: csv_load_exact
+ * ------------------------
+ * Loads the given file into an empty buffer in two passes. The
+ * first pass measures the number of rows, the width of each row and
+ * the total length of the decoded text. The second pass decodes the
+ * file into a single exactly sized chunk holding every CSV_FIELD and
+ * its text, so no memory is reallocated while loading.
+ *
+ * The result is the same as that of csv_load, quirks included (a
+ * field like a"" keeps its "a", and a 0xFF byte ends the input
+ * where char is signed), except for text with embedded '\0's:
+ * csv_load cuts a field short at the first one, csv_load_exact
+ * keeps it whole (see csv_set_field_n). Fields that are later set
+ * to longer text simply move out of the chunk.
+ *
+ * Returns:
+ *  0: success
+ *  1: file not found
+ *  2: failure to allocate the buffer (memory failure), or the file
+ *     changed between the two passes
+ *  3: the buffer is not empty
+ */
+int csv_load_exact(CSV_BUFFER *buffer, char *file_name);
+
+/* Function: csv_save
+ * -----------------------
+ * Saves the csv buffer to a given file. If the file already
+ * exists, it is overwritten. Output is formatted into a block of
+ * CSV_SAVE_BLOCK bytes that is written out whole each time it fills.
+ *
+ * Returns:
+ *  0: success
+ *  1: unable to write to file (invalid name or inufficient
+ *     access, or a write failed)
+ */
+int csv_save(char *file_name, CSV_BUFFER *buffer);
+
+/* Function: write_bytes
+ * -----------------------
+ * Adds size bytes to the output block, flushing it as it fills up.
+ * Runs too long to be worth copying are written directly.
+ */
+static void write_bytes(CSV_WRITER *out, const char *data, size_t size);
+
+/* Function: flush_bytes
+ * -----------------------
+ * Writes out whatever is in the output block.
+ */
+static void flush_bytes(CSV_WRITER *out);
+
+/* Function: csv_copy_row
+ * ----------------------
+ * Deep copy of a row of a CSV_BUFFER. Destination row may
+ * be in the same buffer as source. Adjusts the length of 
+ * the row.
+ *
+ * Returns:
+ *  0: success
+ *  1: the requested src row does not exist
+ */
+int csv_copy_row(CSV_BUFFER *dest, size_t dest_row,
+                        CSV_BUFFER *src, size_t src_row);
+
+/* Function: copy_field
+ * ------------------------
+ * 
+ * Copies a given field from one buffer to another (note, source and
+ * dest buffers MAY be the same.
+ * 
+ * Returns:
+ *  0: success
+ *  1: memory error (see set_field)
+ */
+int csv_copy_field(CSV_BUFFER *dest, int dest_row, int dest_entry,
+                   CSV_BUFFER *source, int source_row, int source_entry);
+
+/* Function: csv_move_row
+ * ----------------------
+ * Takes row src_row out of src (the rows after it move up) and
+ * inserts it into dest so that it becomes row dest_row (the rows
+ * from dest_row on move down; empty rows are added if dest is not
+ * that tall). dest and src may be the same buffer, which reorders
+ * it.
+ *
+ * The fields themselves are moved, not copied, whenever dest can
+ * take ownership of them: within one buffer always, and between
+ * buffers if both use the same allocator, dest is not an arena and
+ * the fields are not borrowed from src's chunks or shared with a
+ * snapshot. Any other field is copied into dest.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or a buffer is frozen (the row
+ *     is not moved, but empty rows may have been added to dest)
+ *  2: the requested src row does not exist
+ */
+int csv_move_row(CSV_BUFFER *dest, size_t dest_row,
+                CSV_BUFFER *src, size_t src_row);
+
+/* Function: csv_swap_rows
+ * ----------------------
+ * Swaps two rows of a buffer by exchanging pointers.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ *  2: one of the rows does not exist
+ */
+int csv_swap_rows(CSV_BUFFER *buffer, size_t a, size_t b);
+
+/* Function: csv_move_field
+ * ----------------------
+ * Moves the text of a field of src to a field of dest (which is
+ * created if needed, as with csv_set_field), leaving the src field
+ * empty. When dest can take ownership of the src field (see
+ * csv_move_row) the two CSV_FIELDs are simply exchanged, otherwise
+ * the text is copied.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or a buffer is frozen
+ *  2: the requested src field does not exist
+ */
+int csv_move_field(CSV_BUFFER *dest, size_t dest_row, size_t dest_entry,
+                CSV_BUFFER *src, size_t src_row, size_t src_entry);
+
+/* Function: same_allocator
+ * ----------------------
+ * Returns: true if memory from one buffer may be freed by the other
+ */
+static bool same_allocator(CSV_BUFFER *a, CSV_BUFFER *b);
+
+/* Function: owned_field
+ * ----------------------
+ * Returns: true if neither the field nor its text live in a chunk
+ */
+static bool owned_field(CSV_FIELD *field);
+
+/* Function: take_row
+ * ----------------------
+ * Hands the fields of row src_row of src over to dest as a row
+ * array that dest owns, moving what it can and copying the rest.
+ * src is left with a stale entry for the row, which the caller must
+ * remove.
+ *
+ * Returns NULL on error via malloc (src is unchanged).
+ */
+static CSV_FIELD **take_row(CSV_BUFFER *dest, CSV_BUFFER *src,
+                size_t src_row, size_t *capacity);
+
+
+/* Function: csv_get_field
+ * ----------------------------------
+ * Copies an entry from a CSV_BUFFER to a string provided.
+ * The caller is expected to provide the string's length.
+ * If the requested cell does not exist, or is empty, the
+ * string is filled with null characters.
+ *
+ * Returns:
+ *  0: the whole entry was copied
+ *  1: the entry was trucated to fit the string
+ *  2: the request cell was empty (or does not exist)
+ *  3: the length given was 0
+ */
+int csv_get_field(char *dest, size_t dest_len, 
+        CSV_BUFFER *src, size_t row, size_t entry);
+
+/* Function: csv_clear_field
+ * -------------------------
+ * 
+ * If the field is the last in the row (and not the first), it is
+ * removed (the width of the row is decremented by one). Otherwise,
+ * it is just cleared, and a spacer remains.
+ *
+ * Returns:
+ *  0: success
+ *  TODO errors
+ */
+int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+/* Function: csv_clear_row
+ * -----------------------
+ * 
+ * Destroys all but one field in the row, and clears that field.
+ * Row size is now 1.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation falirure (note this function only 
+ *      reduces memory used, so reallocation should never fail)
+ */
+int csv_clear_row(CSV_BUFFER *buffer, size_t row);
+
+/* Function: csv_remove_row
+ * ------------------------
+ * 
+ * Completely removes a row from the buffer such that it's two
+ * neighboring rows are now adjacent and buffer height is reduced
+ * by one. Only the removed row is destroyed; the rows after it are
+ * moved up by shifting pointers, not copied.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation falirure (converting back from a flat
+ *     layout), or the buffer is frozen
+ */
+int csv_remove_row(CSV_BUFFER *buffer, size_t row);
+
+/* Function: csv_remove_rows_if
+ * ------------------------
+ * 
+ * Removes every row for which pred returns non-zero, in a single
+ * pass: rejected rows are destroyed and the rest are moved up in
+ * order. pred is called once per row, in order, with the row's
+ * current index and user; it may read that row, but not any other
+ * row, and must not modify the buffer.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation falirure (converting back from a flat
+ *     layout), or the buffer is frozen
+ */
+int csv_remove_rows_if(CSV_BUFFER *buffer,
+                int (*pred)(CSV_BUFFER *buffer, size_t row, void *user),
+                void *user);
+
+/* Function: csv_remove_rows_mask
+ * ------------------------
+ * 
+ * Same as csv_remove_rows_if, but removes row i if bit i % 8 of
+ * mask[i / 8] is set. mask must cover every row of the buffer.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation falirure (converting back from a flat
+ *     layout), or the buffer is frozen
+ */
+int csv_remove_rows_mask(CSV_BUFFER *buffer, const unsigned char *mask);
+
+/* Function: remove_rows
+ * ------------------------
+ * Does the work of csv_remove_rows_if (if pred is not NULL) or
+ * csv_remove_rows_mask.
+ */
+static int remove_rows(CSV_BUFFER *buffer,
+                int (*pred)(CSV_BUFFER *buffer, size_t row, void *user),
+                void *user, const unsigned char *mask);
+
+/* Function: csv_remove_col
+ * ------------------------
+ * 
+ * Completely removes a col from the buffer such that it's two
+ * neighboring cols are now adjacent and buffer height is reduced
+ * by one. Rows too narrow to have the column are left alone, and a
+ * row whose only field is removed keeps one empty cell (see
+ * csv_project_cols).
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation falirure, or the buffer is frozen
+ */
+ int csv_remove_col(CSV_BUFFER *buffer, size_t col);
+
+/* Function: csv_project_cols
+ * ------------------------
+ * 
+ * Rearranges the columns of every row so that column j of the
+ * result is column keep[j] of the original; columns that are not
+ * kept are destroyed. Fields are moved, not copied, and each row is
+ * rearranged in one pass.
+ *
+ * Ragged rows: a row only extends up to the last kept column it
+ * actually has, and kept columns it does not have before that are
+ * empty cells. A row with none of the kept columns is left with a
+ * single empty cell. Rows that the projection would leave as they
+ * are are not touched.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen (the buffer
+ *     is unchanged)
+ *  2: keep names a column more than once (the buffer is unchanged)
+ */
+int csv_project_cols(CSV_BUFFER *buffer, const size_t *keep, size_t n);
+
+/* Function: csv_reorder_cols
+ * ------------------------
+ * 
+ * Permutes the first n columns of every row so that column j of the
+ * result is column perm[j] of the original; columns from n on stay
+ * where they are. This is csv_project_cols with nothing dropped:
+ * fields are moved, not copied, and a row too short for its fields'
+ * new places is padded with empty cells.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen (the buffer
+ *     is unchanged)
+ *  2: perm is not a permutation of 0 to n - 1 (the buffer is
+ *     unchanged)
+ */
+int csv_reorder_cols(CSV_BUFFER *buffer, const size_t *perm, size_t n);
+
+/* Function: csv_transpose
+ * ------------------------
+ * 
+ * Replaces the contents of dest with src turned on its side: field
+ * j of row i of src becomes field i of row j of dest. Row j of dest
+ * ends at the last row of src that has a field j, and rows of src
+ * too short for column j leave empty cells in it.
+ *
+ * Copied fields all go into one block. If take_ownership is true src
+ * is consumed and left empty (it must still be destroyed), and when
+ * both are tree buffers using the same allocator, and dest is not an
+ * arena unless src is one too, the fields themselves move to dest
+ * along with src's chunks; only fields of rows shared with a
+ * snapshot are copied. src may be dest, which transposes it in
+ * place.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or dest is frozen, or src is frozen
+ *     and take_ownership is true (both buffers are unchanged)
+ */
+int csv_transpose(CSV_BUFFER *src, CSV_BUFFER *dest, bool take_ownership);
+
+/* Function: shared_row
+ * ------------------------
+ * Returns: true if a row of the buffer is also held by another
+ */
+static bool shared_row(CSV_BUFFER *buffer, size_t row);
+
+/* Function: project_width
+ * ------------------------
+ * The width of a row of width w after csv_project_cols, or 0 if the
+ * projection leaves the row as it is. kept is set to the number of
+ * the row's fields that are kept.
+ */
+static size_t project_width(const size_t *keep, size_t n, size_t w,
+                size_t *kept);
+
+void csv_set_text_delim(CSV_BUFFER *buffer, char new_delim);
+
+void csv_set_field_delim(CSV_BUFFER *buffer, char new_delim);
+
+int csv_get_height(CSV_BUFFER *buffer);
 /* Returns: height of buffer */
 
-int csv_get_width(CSV_BUFFER *bufer, size_t row);
-/* Returns: width of row (or 0 if row does not exist) */
+int csv_get_width(CSV_BUFFER *bufer, size_t row);
+/* Returns: width of row (or 0 if row does not exist) */
+
+int csv_get_field_length(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+int csv_set_field(CSV_BUFFER *buffer, size_t row, size_t entry,
+        char *field);
+
+/* Function: csv_set_field_n
+ * ------------------------
+ * 
+ * Same as csv_set_field, but takes exactly length bytes of data,
+ * which need not be '\0' terminated. Fields are binary safe: text
+ * with embedded '\0's keeps its length (see csv_get_field_length)
+ * and is copied, saved and read back whole.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ */
+int csv_set_field_n(CSV_BUFFER *buffer, size_t row, size_t entry,
+        const char *data, size_t length);
+
+/* Function: csv_set_field_adopt
+ * ------------------------
+ * 
+ * Same as csv_set_field_n, but the buffer takes ownership of data
+ * instead of copying it. data must have been allocated with the
+ * buffer's allocator (CSV_MALLOC unless the buffer was created with
+ * csv_create_buffer_alloc) with room for length + 1 bytes, as
+ * data[length] is set to '\0'. Short text, and any text given to an
+ * arena buffer, is still copied and data freed straight away.
+ *
+ * data belongs to the buffer even if the call fails, in which case
+ * it is freed.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ */
+int csv_set_field_adopt(CSV_BUFFER *buffer, size_t row, size_t entry,
+        char *data, size_t length);
+
+/* Function: csv_insert_field
+ * ------------------------
+ * 
+ * Inserts a new field holding the given text before the given entry,
+ * moving the rest of the row one place to the right. Only pointers
+ * are moved; the new field is the only allocation. If the entry does
+ * not exist yet, this is the same as csv_set_field.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ */
+int csv_insert_field(CSV_BUFFER *buffer, size_t row, size_t entry,
+        char *field);
+
+/* Function: csv_remove_field
+ * ------------------------
+ * 
+ * Destroys the given field, moving the rest of the row one place to
+ * the left by moving pointers. The only field of a row is cleared
+ * instead.
+ *
+ * Returns:
+ *  0: success
+ *  1: memory allocation failure, or the buffer is frozen
+ */
+int csv_remove_field(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+/*
+ * Print the CSV buffer as it would appear in a csv file 
+*/
+void print_csv(CSV_BUFFER *buffer);
+
+#endif /* CSV_H_ */
+
+
+#ifdef CSV_IMPLEMENTATION
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+static void *default_malloc(void *ctx, size_t size)
+{
+        (void) ctx;
+        return CSV_MALLOC(size);
+}
+
+static void *default_realloc(void *ctx, void *ptr, size_t size)
+{
+        (void) ctx;
+        return CSV_REALLOC(ptr, size);
+}
+
+static void default_free(void *ctx, void *ptr)
+{
+        (void) ctx;
+        CSV_FREE(ptr);
+}
+
+static void *buf_malloc(CSV_BUFFER *buffer, size_t size)
+{
+        return buffer->alloc.malloc(buffer->alloc.ctx, size);
+}
+
+static void *buf_realloc(CSV_BUFFER *buffer, void *ptr, size_t size)
+{
+        return buffer->alloc.realloc(buffer->alloc.ctx, ptr, size);
+}
+
+static void buf_free(CSV_BUFFER *buffer, void *ptr)
+{
+        if (ptr != NULL)
+                buffer->alloc.free(buffer->alloc.ctx, ptr);
+}
+
+static int add_char(CSV_BUFFER *buffer, char **string, int *c, char ch)
+{
+        char *tmp = NULL;
+        (*c)++;
+        tmp = buf_realloc(buffer, *string, (*c)+1);
+        if (tmp == NULL)
+                return 1;
+        *string = tmp;
+        (*string)[(*c)-1] = ch; 
+        (*string)[*c] = '\0';
+
+        return 0;
+}
+
+static CSV_FIELD *create_field(CSV_BUFFER *buffer)
+{
+        CSV_FIELD *field;
+        if (buffer->arena)
+                field = arena_alloc(buffer, sizeof(CSV_FIELD),
+                                sizeof(((CSV_CHUNK *) 0)->data[0]));
+        else
+                field = buf_malloc(buffer, sizeof(CSV_FIELD));
+        if (field == NULL)
+                return NULL;
+        field->length = 0;
+        field->text = NULL;
+        field->flags = buffer->arena ? CSV_FIELD_BORROWED : 0;
+        if (set_field(buffer, field, "\0") != 0) {
+                destroy_field(buffer, field);
+                return NULL;
+        }
+        return field;
+}
+
+static void destroy_field(CSV_BUFFER *buffer, CSV_FIELD *field)
+{
+        if (field->text != NULL && field->text != field->small
+            && !(field->flags & CSV_TEXT_BORROWED)) {
+                buf_free(buffer, field->text);
+                field->text = NULL;
+        }
+        if (!(field->flags & CSV_FIELD_BORROWED))
+                buf_free(buffer, field);
+        field = NULL;
+} 
+
+static int set_field(CSV_BUFFER *buffer, CSV_FIELD *field, char *text)
+{
+        return set_field_n(buffer, field, text, strlen(text));
+}
+
+static int set_field_n(CSV_BUFFER *buffer, CSV_FIELD *field,
+                const char *text, size_t size)
+{
+        
+        char *tmp;
+        size_t length = size + 1;
+        bool owned = field->text != NULL && field->text != field->small
+                && !(field->flags & CSV_TEXT_BORROWED);
+
+        if (length <= CSV_SMALL_TEXT) {
+                memmove(field->small, text, size);
+                field->small[size] = '\0';
+                if (owned)
+                        buf_free(buffer, field->text);
+                field->text = field->small;
+                field->flags &= ~CSV_TEXT_BORROWED;
+                field->length = length;
+                return 0;
+        }
+
+        /* Text living in a chunk can be overwritten in place as long
+         * as it fits, otherwise it moves to a new allocation (from the
+         * arena if there is one). */
+        if (field->flags & CSV_TEXT_BORROWED) {
+                if (length <= field->length) {
+                        memmove(field->text, text, size);
+                        field->text[size] = '\0';
+                        field->length = length;
+                        return 0;
+                }
+                if (buffer->arena)
+                        tmp = arena_alloc(buffer, length, 1);
+                else
+                        tmp = buf_malloc(buffer, length);
+        } else if (buffer->arena) {
+                tmp = arena_alloc(buffer, length, 1);
+        } else if (owned) {
+                tmp = buf_realloc(buffer, field->text, length);
+        } else {
+                tmp = buf_malloc(buffer, length);
+        }
+        if (tmp == NULL)
+                return 1;
+        field->text = tmp;
+        if (buffer->arena)
+                field->flags |= CSV_TEXT_BORROWED;
+        else
+                field->flags &= ~CSV_TEXT_BORROWED;
+        field->length = length;
+        memmove(field->text, text, size);
+        field->text[size] = '\0';
+
+        return 0;
+}
+
+static int adopt_text(CSV_BUFFER *buffer, CSV_FIELD *field,
+                char *data, size_t length)
+{
+        if (length + 1 <= CSV_SMALL_TEXT || buffer->arena) {
+                int status = set_field_n(buffer, field, data, length);
+                buf_free(buffer, data);
+                return status;
+        }
+
+        if (field->text != NULL && field->text != field->small
+            && !(field->flags & CSV_TEXT_BORROWED))
+                buf_free(buffer, field->text);
+        data[length] = '\0';
+        field->text = data;
+        field->flags &= ~CSV_TEXT_BORROWED;
+        field->length = length + 1;
+
+        return 0;
+}
+
+static int read_next_field(FILE *fp, CSV_BUFFER *buffer,
+                CSV_FIELD *field)
+{
+
+        char field_delim = buffer->field_delim;
+        char text_delim = buffer->text_delim;
+        char ch = 'a';
+
+        bool done = false;
+        bool in_text = false;
+        bool esc = false;
+
+        int c = 0;
+        char *tmp = buf_malloc(buffer, 1);
+        tmp[0] = '\0';
+        while (!done) {
+                ch = getc(fp);
+
+                if (ch == EOF) {
+                        c = 0;
+                        done = true;
+                } else if (!in_text) {
+                        if (ch == text_delim) {
+                                in_text = true;
+                                c = 0;
+                        } else if (ch == field_delim) {
+                                done = true; 
+                        } else if (ch == '\n') {
+                                done = true;
+                        } else { 
+                               add_char(buffer, &tmp, &c, ch);
+                        }  
+                } else { /* in_text == true */
+                        if (esc) {
+                                if (ch == text_delim) {
+                                        add_char(buffer, &tmp, &c, ch);
+                                        esc = false;
+                                } else {
+                                        esc = false;
+                                        done = true;
+                                }
+                        } else { /* !esc */
+                                if (ch == text_delim) {
+                                        esc = true;
+                                } else if (ch == field_delim) {
+                                        add_char(buffer, &tmp, &c, ch);
+                                } else {
+                                        add_char(buffer, &tmp, &c, ch);
+                                }
+                        }
+                }
+        } 
+        if (field != NULL){
+                set_field(buffer, field, tmp);
+         }
+
+        if (tmp != NULL)
+                buf_free(buffer, tmp);
+        tmp = NULL;
+
+        /* Moving the fp to the beginning of the next field and peeking 
+         * to see if it is a new line or if there is in fact no next field.
+         */
+        fpos_t pos;
+        int retval;
+        done = false;
+        while (!done) {
+                if (ch == field_delim) {
+                        retval = 0;
+                        done = true;
+                }
+                else if (ch == '\n') {
+                        /* Checking to see if this \n is the one that UNIX
+                         * sometimes includes before the EOF */
+                        fgetpos(fp, &pos);
+                        ch = getc(fp);
+                        if (ch == EOF)
+                                retval = 2;
+                        else
+                                retval = 1;
+                        fsetpos(fp, &pos);
+                        done = true;
+                }
+                else if (ch == EOF) {
+                        retval = 2;
+                        done = true;
+                } else {
+                        ch = getc(fp);
+                }
+        }
+
+        return retval;
+}
+
+static int scan_field(FILE *fp,
+                char field_delim, char text_delim,
+                char *dest, size_t room, size_t *length)
+{
+
+        /* A char, as in read_next_field: a 0xFF byte ends the input
+         * wherever char is signed */
+        char ch = 'a';
+
+        bool done = false;
+        bool in_text = false;
+        bool esc = false;
+
+        /* read_next_field restarts at an opening text delim but keeps
+         * its old text until something overwrites it, so c (where the
+         * next character goes) and len (the text so far) can differ */
+        size_t c = 0, len = 0;
+
+/* Store a decoded character, or just count it when measuring */
+#define SCAN_PUT(x) do { \
+                if (dest != NULL && c + 1 < room) \
+                        dest[c] = (x); \
+                len = ++c; \
+        } while (0)
+
+        while (!done) {
+                ch = getc(fp);
+
+                if (ch == EOF) {
+                        done = true;
+                } else if (!in_text) {
+                        if (ch == text_delim) {
+                                in_text = true;
+                                c = 0;
+                        } else if (ch == field_delim || ch == '\n') {
+                                done = true;
+                        } else {
+                                SCAN_PUT(ch);
+                        }
+                } else if (esc) {
+                        esc = false;
+                        if (ch == text_delim)
+                                SCAN_PUT(ch);
+                        else
+                                done = true;
+                } else if (ch == text_delim) {
+                        esc = true;
+                } else {
+                        SCAN_PUT(ch);
+                }
+        }
+#undef SCAN_PUT
+
+        if (dest != NULL && room > 0)
+                dest[len < room ? len : room - 1] = '\0';
+        *length = len;
+
+        /* Skip to the beginning of the next field exactly as
+         * read_next_field does. */
+        fpos_t pos;
+        while (true) {
+                if (ch == field_delim) {
+                        return 0;
+                } else if (ch == '\n') {
+                        fgetpos(fp, &pos);
+                        ch = getc(fp);
+                        fsetpos(fp, &pos);
+                        return ch == EOF ? 2 : 1;
+                } else if (ch == EOF) {
+                        return 2;
+                }
+                ch = getc(fp);
+        }
+}
+
+static CSV_CHUNK *add_chunk(CSV_BUFFER *buffer, size_t size)
+{
+        bool fresh = buffer->store == NULL;
+        if (fresh) {
+                buffer->store = buf_malloc(buffer, sizeof(CSV_STORE));
+                if (buffer->store == NULL)
+                        return NULL;
+                CSV_REF_INIT(buffer->store->refs, 1);
+                buffer->store->chunks = NULL;
+                buffer->store->parent = NULL;
+        }
+
+        CSV_CHUNK *chunk = buf_malloc(buffer, sizeof(CSV_CHUNK) + size);
+        if (chunk == NULL) {
+                /* A flat layout never frees its store, so don't leave
+                 * an empty one behind */
+                if (fresh) {
+                        buf_free(buffer, buffer->store);
+                        buffer->store = NULL;
+                }
+                return NULL;
+        }
+
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = buffer->store->chunks;
+        buffer->store->chunks = chunk;
+
+        return chunk;
+}
+
+static void place_text(CSV_FIELD *cell, char **dest, size_t length)
+{
+        if (length <= CSV_SMALL_TEXT) {
+                memcpy(cell->small, *dest, length);
+                cell->text = cell->small;
+                cell->flags = CSV_FIELD_BORROWED;
+        } else {
+                cell->text = *dest;
+                cell->flags = CSV_FIELD_BORROWED | CSV_TEXT_BORROWED;
+                *dest += length;
+        }
+        cell->length = length;
+}
+
+static void *arena_alloc(CSV_BUFFER *buffer, size_t size, size_t align)
+{
+        CSV_CHUNK *chunk = buffer->store != NULL ? buffer->store->chunks : NULL;
+        size_t start = 0;
+
+        if (chunk != NULL)
+                start = (chunk->used + align - 1) / align * align;
+        if (chunk == NULL || start + size > chunk->size) {
+                chunk = add_chunk(buffer, size > buffer->arena ?
+                                size : buffer->arena);
+                if (chunk == NULL)
+                        return NULL;
+                if (buffer->arena < CSV_ARENA_MAX)
+                        buffer->arena *= 2;
+                start = 0;
+        }
+        chunk->used = start + size;
+
+        return (char *) chunk->data + start;
+}
+
+static char *cell_text(CSV_BUFFER *buffer, size_t row, size_t entry,
+                size_t *length)
+{
+        CSV_CELL *cell;
+        char *text;
+
+        if (buffer->grid != NULL) {
+                cell = &buffer->grid->cell[buffer->grid->start[row] + entry];
+                text = buffer->grid->text;
+        } else if (buffer->column != NULL) {
+                CSV_COLUMN *column = &buffer->column[entry];
+                cell = &column->cell[column->code != NULL ? column->code[row] : row];
+                text = column->text;
+        } else {
+                if (length != NULL)
+                        *length = buffer->field[row][entry]->length;
+                return buffer->field[row][entry]->text;
+        }
+
+        if (length != NULL)
+                *length = cell->length;
+        return text + cell->offset;
+}
+
+static CSV_FIELD ***alloc_rows(CSV_BUFFER *buffer, size_t rows,
+                size_t capacity, const size_t *width, size_t **row_capacity)
+{
+        if (capacity == 0)
+                capacity = 1;
+        CSV_FIELD ***field = buf_malloc(buffer, capacity * sizeof(CSV_FIELD**));
+        *row_capacity = buf_malloc(buffer, capacity * sizeof(size_t));
+        if (field == NULL || *row_capacity == NULL) {
+                buf_free(buffer, field);
+                buf_free(buffer, *row_capacity);
+                return NULL;
+        }
+
+        for (size_t i = 0; i < rows; i++) {
+                field[i] = buf_malloc(buffer, (width[i] ? width[i] : 1) * sizeof(CSV_FIELD*));
+                (*row_capacity)[i] = width[i];
+                if (field[i] == NULL) {
+                        while (i-- > 0)
+                                buf_free(buffer, field[i]);
+                        buf_free(buffer, field);
+                        buf_free(buffer, *row_capacity);
+                        return NULL;
+                }
+        }
+
+        return field;
+}
+
+static int grow_rows(CSV_BUFFER *buffer, size_t capacity)
+{
+        if (capacity <= buffer->capacity)
+                return 0;
+
+        size_t *temp_width = buf_realloc(buffer, buffer->width, capacity * sizeof(size_t));
+        if (temp_width == NULL)
+                return 1;
+        buffer->width = temp_width;
+
+        /* The flat layouts only keep the width array */
+        if (buffer->grid == NULL && buffer->column == NULL) {
+                CSV_FIELD ***temp_field = buf_realloc(buffer, buffer->field,
+                                capacity * sizeof(CSV_FIELD**));
+                if (temp_field == NULL)
+                        return 1;
+                buffer->field = temp_field;
+
+                size_t *temp_capacity = buf_realloc(buffer, buffer->row_capacity,
+                                capacity * sizeof(size_t));
+                if (temp_capacity == NULL)
+                        return 1;
+                buffer->row_capacity = temp_capacity;
+
+                if (buffer->share != NULL) {
+                        CSV_SHARE **temp_share = buf_realloc(buffer, buffer->share,
+                                        capacity * sizeof(CSV_SHARE*));
+                        if (temp_share == NULL)
+                                return 1;
+                        buffer->share = temp_share;
+                }
+        }
+
+        buffer->capacity = capacity;
+        return 0;
+}
+
+static int grow_row(CSV_BUFFER *buffer, size_t row, size_t capacity)
+{
+        if (capacity <= buffer->row_capacity[row])
+                return 0;
+        if (own_row(buffer, row) != 0)
+                return 1;
+
+        CSV_FIELD **temp_row = buf_realloc(buffer, buffer->field[row],
+                        capacity * sizeof(CSV_FIELD*));
+        if (temp_row == NULL)
+                return 1;
+
+        buffer->field[row] = temp_row;
+        buffer->row_capacity[row] = capacity;
+        return 0;
+}
+
+static void destroy_row(CSV_BUFFER *buffer, CSV_FIELD **row, size_t width)
+{
+        /* Arena fields go away with the chunks */
+        for (size_t j = 0; !buffer->arena && j < width; j++)
+                destroy_field(buffer, row[j]);
+        buf_free(buffer, row);
+}
+
+static void release_row(CSV_BUFFER *buffer, size_t row)
+{
+        CSV_SHARE *share = buffer->share != NULL ? buffer->share[row] : NULL;
+
+        /* Kept for csv_rollback */
+        if (txn_row(buffer, row)) {
+                CSV_UNDO *undo = &buffer->txn->log[buffer->txn->logged++];
+                undo->row = buffer->field[row];
+                undo->width = buffer->width[row];
+                undo->share = NULL;
+                buffer->share[row] = NULL;
+                buffer->field[row] = NULL;
+                return;
+        }
+        if (share != NULL) {
+                buffer->share[row] = NULL;
+                if (CSV_REF_DEC(share->refs) != 0) {
+                        buffer->field[row] = NULL;
+                        return;
+                }
+                buf_free(buffer, share);
+        }
+        destroy_row(buffer, buffer->field[row], buffer->width[row]);
+        buffer->field[row] = NULL;
+}
+
+static int own_row(CSV_BUFFER *buffer, size_t row)
+{
+        CSV_SHARE *share = buffer->share != NULL ? buffer->share[row] : NULL;
+
+        if (share == NULL)
+                return 0;
+        /* Every other holder has let go already */
+        if (CSV_REF_GET(share->refs) == 1) {
+                buf_free(buffer, share);
+                buffer->share[row] = NULL;
+                return 0;
+        }
+
+        size_t width = buffer->width[row];
+        size_t capacity = buffer->row_capacity[row];
+        CSV_FIELD **copy = buf_malloc(buffer, (capacity ? capacity : 1) * sizeof(CSV_FIELD*));
+        if (copy == NULL)
+                return 1;
+        for (size_t j = 0; j < width; j++) {
+                copy[j] = create_field(buffer);
+                if (copy[j] == NULL
+                    || set_field_n(buffer, copy[j], buffer->field[row][j]->text,
+                                   buffer->field[row][j]->length - 1) != 0) {
+                        if (copy[j] != NULL)
+                                j++;
+                        destroy_row(buffer, copy, j);
+                        return 1;
+                }
+        }
+
+        release_row(buffer, row);
+        buffer->field[row] = copy;
+        return 0;
+}
+
+static CSV_SHARE *share_row(CSV_BUFFER *buffer, size_t row)
+{
+        if (buffer->share == NULL) {
+                buffer->share = buf_malloc(buffer, (buffer->capacity ?
+                                        buffer->capacity : 1) * sizeof(CSV_SHARE*));
+                if (buffer->share == NULL)
+                        return NULL;
+                for (size_t i = 0; i < buffer->capacity; i++)
+                        buffer->share[i] = NULL;
+        }
+        if (buffer->share[row] == NULL || txn_row(buffer, row)) {
+                CSV_SHARE *share = buf_malloc(buffer, sizeof(CSV_SHARE));
+                if (share == NULL)
+                        return NULL;
+                CSV_REF_INIT(share->refs, 1);
+                /* The transaction becomes a holder like any other */
+                if (txn_row(buffer, row)) {
+                        CSV_UNDO *undo = &buffer->txn->log[buffer->txn->logged++];
+                        undo->row = buffer->field[row];
+                        undo->width = buffer->width[row];
+                        undo->share = share;
+                        CSV_REF_INC(share->refs);
+                }
+                buffer->share[row] = share;
+        }
+
+        CSV_REF_INC(buffer->share[row]->refs);
+        return buffer->share[row];
+}
+
+static void move_rows(CSV_BUFFER *buffer, size_t to, size_t from, size_t count)
+{
+        memmove(buffer->field + to, buffer->field + from, count * sizeof(CSV_FIELD**));
+        memmove(buffer->width + to, buffer->width + from, count * sizeof(size_t));
+        memmove(buffer->row_capacity + to, buffer->row_capacity + from,
+                        count * sizeof(size_t));
+        if (buffer->share != NULL)
+                memmove(buffer->share + to, buffer->share + from,
+                                count * sizeof(CSV_SHARE*));
+}
+
+static void release_store(CSV_BUFFER *buffer, CSV_STORE *store)
+{
+        while (store != NULL && CSV_REF_DEC(store->refs) == 0) {
+                CSV_STORE *parent = store->parent;
+                while (store->chunks != NULL) {
+                        CSV_CHUNK *next = store->chunks->next;
+                        buf_free(buffer, store->chunks);
+                        store->chunks = next;
+                }
+                buf_free(buffer, store);
+                store = parent;
+        }
+}
+
+static void free_tree(CSV_BUFFER *buffer)
+{
+        for (size_t i = 0; buffer->field != NULL && i < buffer->rows; i++)
+                release_row(buffer, i);
 
-int csv_get_field_length(CSV_BUFFER *buffer, size_t row, size_t entry);
+        if (buffer->field != NULL)
+                buf_free(buffer, buffer->field);
+        buffer->field = NULL;
+        buf_free(buffer, buffer->row_capacity);
+        buffer->row_capacity = NULL;
+        buf_free(buffer, buffer->share);
+        buffer->share = NULL;
+
+        release_store(buffer, buffer->store);
+        buffer->store = NULL;
+}
 
-int csv_set_field(CSV_BUFFER *buffer, size_t row, size_t entry,
-        char *field);
+static void free_layout(CSV_BUFFER *buffer)
+{
+        /* A shared flat layout is freed by the last buffer using it */
+        if (buffer->layout_share != NULL) {
+                CSV_SHARE *share = buffer->layout_share;
+                buffer->layout_share = NULL;
+                if (CSV_REF_DEC(share->refs) != 0) {
+                        buffer->grid = NULL;
+                        buffer->column = NULL;
+                        buffer->columns = 0;
+                        return;
+                }
+                buf_free(buffer, share);
+        }
+
+        if (buffer->grid != NULL) {
+                buf_free(buffer, buffer->grid);
+                buffer->grid = NULL;
+        } else if (buffer->column != NULL) {
+                for (size_t j = 0; j < buffer->columns; j++)
+                        buf_free(buffer, buffer->column[j].cell);
+                buf_free(buffer, buffer->column);
+                buffer->column = NULL;
+                buffer->columns = 0;
+        } else {
+                free_tree(buffer);
+        }
+}
+
+static int to_tree(CSV_BUFFER *buffer)
+{
+        if (buffer->frozen)
+                return 1;
+        if (buffer->grid == NULL && buffer->column == NULL)
+                return 0;
+
+        size_t cells = 0, text = 0, length;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                cells += buffer->width[i];
+                for (size_t j = 0; j < buffer->width[i]; j++) {
+                        cell_text(buffer, i, j, &length);
+                        if (length > CSV_SMALL_TEXT)
+                                text += length;
+                }
+        }
+
+        size_t *row_capacity;
+        CSV_FIELD ***field = alloc_rows(buffer, buffer->rows, buffer->capacity,
+                        buffer->width, &row_capacity);
+        if (field == NULL)
+                return 1;
+        CSV_CHUNK *chunk = add_chunk(buffer, cells * sizeof(CSV_FIELD)
+                        + text + CSV_SMALL_TEXT);
+        if (chunk == NULL) {
+                for (size_t i = 0; i < buffer->rows; i++)
+                        buf_free(buffer, field[i]);
+                buf_free(buffer, field);
+                buf_free(buffer, row_capacity);
+                return 1;
+        }
+        chunk->used = chunk->size;
+
+        CSV_FIELD *cell = (CSV_FIELD *) chunk->data;
+        char *dest = (char *) (cell + cells);
+        for (size_t i = 0; i < buffer->rows; i++) {
+                for (size_t j = 0; j < buffer->width[i]; j++) {
+                        char *from = cell_text(buffer, i, j, &length);
+                        memcpy(dest, from, length);
+                        place_text(cell, &dest, length);
+                        field[i][j] = cell++;
+                }
+        }
+
+        free_layout(buffer);
+        buffer->field = field;
+        buffer->row_capacity = row_capacity;
+        return 0;
+}
+
+static int to_rows(CSV_BUFFER *buffer)
+{
+        size_t cells = 0, text = 0, length;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                cells += buffer->width[i];
+                for (size_t j = 0; j < buffer->width[i]; j++) {
+                        cell_text(buffer, i, j, &length);
+                        text += length;
+                }
+        }
+
+        CSV_GRID *grid = buf_malloc(buffer, sizeof(CSV_GRID)
+                        + cells * sizeof(CSV_CELL)
+                        + (buffer->rows + 1) * sizeof(size_t) + text);
+        if (grid == NULL)
+                return 1;
+        grid->cell = (CSV_CELL *) (grid + 1);
+        grid->start = (size_t *) (grid->cell + cells);
+        grid->text = (char *) (grid->start + buffer->rows + 1);
+
+        size_t k = 0, offset = 0;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                grid->start[i] = k;
+                for (size_t j = 0; j < buffer->width[i]; j++, k++) {
+                        char *from = cell_text(buffer, i, j, &length);
+                        memcpy(grid->text + offset, from, length);
+                        grid->cell[k].offset = offset;
+                        grid->cell[k].length = length;
+                        offset += length;
+                }
+        }
+        grid->start[buffer->rows] = k;
+
+        free_layout(buffer);
+        buffer->grid = grid;
+        return 0;
+}
+
+static uint32_t hash_text(const char *text, size_t length)
+{
+        uint32_t hash = 2166136261u;
+        for (size_t k = 0; k < length; k++) {
+                hash ^= (unsigned char) text[k];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+static int build_column(CSV_BUFFER *buffer, size_t j, CSV_COLUMN *column)
+{
+        size_t present = 0, text = 0, distinct = 0, length;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                if (j < buffer->width[i]) {
+                        cell_text(buffer, i, j, &length);
+                        text += length;
+                        present++;
+                }
+        }
+
+        /* Intern the values into an open addressing table of row
+         * numbers, numbering them in order of first appearance. */
+        uint32_t *code = NULL;
+        size_t *first = NULL, slots = 1;
+        size_t dict_text = 0;
+        if (CSV_DICT_RATIO > 0 && buffer->rows >= CSV_DICT_RATIO
+            && buffer->rows < CSV_NO_CODE) {
+                while (slots < 2 * present)
+                        slots *= 2;
+                code = buf_malloc(buffer, buffer->rows * sizeof(uint32_t));
+                first = buf_malloc(buffer, slots * sizeof(size_t));
+                if (code == NULL || first == NULL) {
+                        buf_free(buffer, code);
+                        buf_free(buffer, first);
+                        return 1;
+                }
+                for (size_t k = 0; k < slots; k++)
+                        first[k] = SIZE_MAX;
+        }
+        for (size_t i = 0; code != NULL && i < buffer->rows; i++) {
+                if (j >= buffer->width[i]) {
+                        code[i] = CSV_NO_CODE;
+                        continue;
+                }
+                char *value = cell_text(buffer, i, j, &length);
+                size_t k = hash_text(value, length) & (slots - 1);
+                while (first[k] != SIZE_MAX) {
+                        size_t other_length;
+                        char *other = cell_text(buffer, first[k], j, &other_length);
+                        if (other_length == length
+                            && memcmp(other, value, length) == 0)
+                                break;
+                        k = (k + 1) & (slots - 1);
+                }
+                if (first[k] == SIZE_MAX) {
+                        first[k] = i;
+                        code[i] = distinct++;
+                        dict_text += length;
+                } else {
+                        code[i] = code[first[k]];
+                }
+        }
+        buf_free(buffer, first);
+
+        if (code != NULL && distinct * CSV_DICT_RATIO > buffer->rows) {
+                buf_free(buffer, code);
+                code = NULL;
+        }
+
+        size_t cells = code != NULL ? distinct : buffer->rows;
+        size_t codes = code != NULL ? buffer->rows : 0;
+        if (code != NULL)
+                text = dict_text;
+        column->cell = buf_malloc(buffer, cells * sizeof(CSV_CELL)
+                        + codes * sizeof(uint32_t) + text);
+        if (column->cell == NULL) {
+                buf_free(buffer, code);
+                return 1;
+        }
+        column->code = code != NULL ? (uint32_t *) (column->cell + cells) : NULL;
+        column->distinct = code != NULL ? distinct : 0;
+        column->text = (char *) (column->cell + cells) + codes * sizeof(uint32_t);
+
+        size_t offset = 0, next = 0;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                CSV_CELL *cell;
+                if (code != NULL) {
+                        column->code[i] = code[i];
+                        /* Only the first row with a value stores it */
+                        if (code[i] != next)
+                                continue;
+                        cell = &column->cell[next++];
+                } else {
+                        cell = &column->cell[i];
+                        if (j >= buffer->width[i]) {
+                                cell->offset = 0;
+                                cell->length = 0;
+                                continue;
+                        }
+                }
+                char *from = cell_text(buffer, i, j, &length);
+                memcpy(column->text + offset, from, length);
+                cell->offset = offset;
+                cell->length = length;
+                offset += length;
+        }
+        buf_free(buffer, code);
+
+        return 0;
+}
+
+static int to_columns(CSV_BUFFER *buffer)
+{
+        size_t columns = 0;
+        for (size_t i = 0; i < buffer->rows; i++)
+                if (buffer->width[i] > columns)
+                        columns = buffer->width[i];
+
+        CSV_COLUMN *column = buf_malloc(buffer, (columns ? columns : 1) * sizeof(CSV_COLUMN));
+        if (column == NULL)
+                return 1;
+
+        for (size_t j = 0; j < columns; j++) {
+                if (build_column(buffer, j, &column[j]) != 0) {
+                        while (j-- > 0)
+                                buf_free(buffer, column[j].cell);
+                        buf_free(buffer, column);
+                        return 1;
+                }
+        }
+
+        free_layout(buffer);
+        buffer->column = column;
+        buffer->columns = columns;
+        return 0;
+}
+
+static int append_field(CSV_BUFFER *buffer, size_t row)
+{
+
+        CSV_FIELD *field;
+
+        if (buffer->rows < row + 1)
+                return 1;
+        if (own_row(buffer, row) != 0)
+                return 2;
+
+        /* Set col equal to the index of the new field */
+        size_t col = buffer->width[row];
+
+        if (col == buffer->row_capacity[row]
+            && grow_row(buffer, row, col < 2 ? 4 : 2 * col) != 0)
+                return 2;
+
+        field = create_field(buffer);
+        if (field == NULL)
+                return 2;
+        buffer->field[row][col] = field;
+        buffer->width[row]++;
+
+        return 0;
+}
+
+static int append_row(CSV_BUFFER *buffer)
+{
+        size_t row  = buffer->rows;
+
+        if (row == buffer->capacity
+            && grow_rows(buffer, row < 4 ? 8 : 2 * row) != 0)
+                return 1;
+
+        buffer->width[row] = 0;
+        buffer->field[row] = NULL;
+        buffer->row_capacity[row] = 0;
+        if (buffer->share != NULL)
+                buffer->share[row] = NULL;
+        buffer->rows++;
+
+        if (append_field(buffer, row) != 0) {
+                buffer->rows--;
+                buf_free(buffer, buffer->field[row]);
+                return 2;
+        }
+        return 0;
+}
+
+static int remove_last_field(CSV_BUFFER *buffer, size_t row)
+{
+
+        /* If there are no entries in the row there is nothing to
+         * remove, but return success because this is expected */
+        if (row > buffer->rows - 1) 
+                return 0;
+        /* If t he row exists, but has no fields, something went
+         * wrong; every row in the scope should have at least one
+         * field. 
+         */
+        else if (buffer->width[row] == 0)
+                return 1;
+        /* If there is only one entry left, just clear it. If the 
+         * caller wants to remove the row, she will call
+         * csv_remove_row.
+         */
+        else if (buffer->width[row] == 1) {
+                csv_clear_field(buffer, row, 0);
+                return 0;
+        }
+        /* Otherwise destroy the final field and decrement the width */
+        else {
+                if (own_row(buffer, row) != 0)
+                        return 2;
+                buffer->width[row]--;
+                destroy_field(buffer, buffer->field[row][buffer->width[row]]);
+        }
+
+        return 0;
+}
+
+static int remove_last_row(CSV_BUFFER *buffer)
+{
+
+        size_t row = buffer->rows - 1;
+
+        release_row(buffer, row);
+        buffer->rows--;
+
+        return 0;
+}
+
+CSV_BUFFER *csv_create_buffer()
+{
+        CSV_ALLOCATOR allocator = {
+                default_malloc, default_realloc, default_free, NULL
+        };
+
+        return csv_create_buffer_alloc(&allocator);
+}
+
+CSV_BUFFER *csv_create_buffer_alloc(const CSV_ALLOCATOR *allocator)
+{
+
+        CSV_BUFFER *buffer = allocator->malloc(allocator->ctx, sizeof(CSV_BUFFER));
+
+        if (buffer != NULL) {
+                buffer->alloc = *allocator;
+                buffer->field = NULL;
+                buffer->rows = 0;
+                buffer->width = NULL;
+                buffer->capacity = 0;
+                buffer->row_capacity = NULL;
+                buffer->field_delim = ',';
+                buffer->text_delim = '"';
+                buffer->store = NULL;
+                buffer->arena = 0;
+                buffer->grid = NULL;
+                buffer->column = NULL;
+                buffer->columns = 0;
+                buffer->share = NULL;
+                buffer->layout_share = NULL;
+                CSV_REF_INIT(buffer->refs, 1);
+                buffer->frozen = 0;
+                buffer->txn = NULL;
+        }
+
+        return buffer;
+}
+
+void csv_destroy_buffer(CSV_BUFFER *buffer)
+{
+
+        if (CSV_REF_DEC(buffer->refs) != 0)
+                return;
+
+        csv_commit(buffer);
+        free_layout(buffer);
+
+        if (buffer->width != NULL)
+                buf_free(buffer, buffer->width);
+
+        buf_free(buffer, buffer);
+}
+
+void csv_memory_stats(CSV_BUFFER *buffer, CSV_STATS *stats)
+{
+        size_t rows = buffer->rows;
+        size_t spare = buffer->capacity - rows;
+
+        memset(stats, 0, sizeof(CSV_STATS));
+        stats->overhead = sizeof(CSV_BUFFER);
+        stats->allocations = 1;
+        if (buffer->width != NULL) {
+                stats->width = rows * sizeof(size_t);
+                stats->slack = spare * sizeof(size_t);
+                stats->allocations++;
+        }
+        if (buffer->layout_share != NULL) {
+                stats->overhead += sizeof(CSV_SHARE);
+                stats->allocations++;
+        }
+
+        if (buffer->grid != NULL) {
+                CSV_GRID *grid = buffer->grid;
+                size_t cells = grid->start[rows];
+                stats->cells = sizeof(CSV_GRID) + cells * sizeof(CSV_CELL)
+                        + (rows + 1) * sizeof(size_t);
+                for (size_t k = 0; k < cells; k++)
+                        stats->text += grid->cell[k].length;
+                stats->allocations++;
+        } else if (buffer->column != NULL) {
+                stats->cells = buffer->columns * sizeof(CSV_COLUMN);
+                stats->allocations++;
+                for (size_t j = 0; j < buffer->columns; j++) {
+                        CSV_COLUMN *column = &buffer->column[j];
+                        size_t cells = column->code != NULL ? column->distinct : rows;
+                        stats->cells += cells * sizeof(CSV_CELL);
+                        if (column->code != NULL)
+                                stats->cells += rows * sizeof(uint32_t);
+                        for (size_t k = 0; k < cells; k++)
+                                stats->text += column->cell[k].length;
+                        stats->allocations++;
+                }
+        } else if (buffer->field != NULL) {
+                /* The row table, row_capacity and share arrays */
+                stats->rows = rows * sizeof(CSV_FIELD**);
+                stats->width += rows * sizeof(size_t);
+                stats->slack += spare * (sizeof(CSV_FIELD**) + sizeof(size_t));
+                stats->allocations += 2;
+                if (buffer->share != NULL) {
+                        stats->rows += rows * sizeof(CSV_SHARE*);
+                        stats->slack += spare * sizeof(CSV_SHARE*);
+                        stats->allocations++;
+                }
+        }
+        if (buffer->layout_share != NULL)
+                stats->shared = stats->cells + stats->text;
+
+        /* Bytes of fields and text living in chunks */
+        size_t borrowed = 0;
+        for (size_t i = 0; buffer->field != NULL && i < rows; i++) {
+                size_t width = buffer->width[i];
+                size_t row = width * sizeof(CSV_FIELD*), text = 0;
+
+                stats->slack += (buffer->row_capacity[i] - width) * sizeof(CSV_FIELD*);
+                stats->allocations++;
+                for (size_t j = 0; j < width; j++) {
+                        CSV_FIELD *field = buffer->field[i][j];
+                        if (field->flags & CSV_FIELD_BORROWED)
+                                borrowed += sizeof(CSV_FIELD);
+                        else
+                                stats->allocations++;
+                        if (field->text == field->small)
+                                continue;
+                        text += field->length;
+                        if (field->flags & CSV_TEXT_BORROWED)
+                                borrowed += field->length;
+                        else
+                                stats->allocations++;
+                }
+
+                stats->rows += row;
+                stats->fields += width * sizeof(CSV_FIELD);
+                stats->text += text;
+                if (buffer->share != NULL && buffer->share[i] != NULL
+                    && !txn_row(buffer, i)) {
+                        stats->shared += row + width * sizeof(CSV_FIELD) + text;
+                        stats->overhead += sizeof(CSV_SHARE);
+                        stats->allocations++;
+                }
+        }
+
+        if (buffer->store != NULL) {
+                size_t chunks = 0;
+                stats->overhead += sizeof(CSV_STORE);
+                stats->allocations++;
+                for (CSV_CHUNK *chunk = buffer->store->chunks; chunk != NULL;
+                     chunk = chunk->next) {
+                        stats->overhead += sizeof(CSV_CHUNK);
+                        stats->allocations++;
+                        chunks += chunk->size;
+                }
+                if (chunks > borrowed)
+                        stats->slack += chunks - borrowed;
+        }
+
+        if (buffer->txn != NULL) {
+                size_t saved = buffer->txn->rows ? buffer->txn->rows : 1;
+                stats->overhead += sizeof(CSV_TXN) + saved * (sizeof(CSV_FIELD**)
+                        + 2 * sizeof(size_t) + sizeof(CSV_SHARE*) + sizeof(CSV_UNDO));
+                stats->allocations += 6;
+        }
+
+        stats->total = stats->text + stats->fields + stats->cells
+                + stats->rows + stats->width + stats->overhead + stats->slack;
+}
+
+int csv_compact(CSV_BUFFER *buffer, size_t *reclaimed)
+{
+        CSV_STATS before, after;
+        int layout = csv_get_layout(buffer);
+
+        if (reclaimed != NULL)
+                *reclaimed = 0;
+        if (buffer->frozen)
+                return 1;
+        csv_memory_stats(buffer, &before);
+
+        /* Pack everything into a grid first; this already frees the
+         * fragmented fields of a tree. */
+        if (layout != CSV_LAYOUT_ROWS && to_rows(buffer) != 0)
+                return 1;
+
+        /* The grid still finds every cell after widths shrink */
+        for (size_t i = 0; i < buffer->rows; i++) {
+                size_t length;
+                while (buffer->width[i] > 1) {
+                        cell_text(buffer, i, buffer->width[i] - 1, &length);
+                        if (length > 1)
+                                break;
+                        buffer->width[i]--;
+                }
+        }
+        if (buffer->rows > 0 && buffer->rows < buffer->capacity) {
+                size_t *width = buf_realloc(buffer, buffer->width,
+                                buffer->rows * sizeof(size_t));
+                if (width != NULL) {
+                        buffer->width = width;
+                        buffer->capacity = buffer->rows;
+                }
+        }
+
+        /* Rebuild the requested layout from the grid */
+        int status;
+        switch (layout) {
+        case CSV_LAYOUT_TREE:
+                status = to_tree(buffer);
+                break;
+        case CSV_LAYOUT_COLUMNS:
+                status = to_columns(buffer);
+                break;
+        default:
+                status = to_rows(buffer);
+                break;
+        }
+        if (status != 0)
+                return 1;
+
+        csv_memory_stats(buffer, &after);
+        if (reclaimed != NULL && before.total > after.total)
+                *reclaimed = before.total - after.total;
+        return 0;
+}
+
+CSV_BUFFER *csv_retain(CSV_BUFFER *buffer)
+{
+        CSV_REF_INC(buffer->refs);
+        return buffer;
+}
+
+int csv_freeze(CSV_BUFFER *buffer)
+{
+        if (buffer->frozen)
+                return 0;
+        if (buffer->txn != NULL)
+                return 1;
+        if (buffer->grid == NULL && to_rows(buffer) != 0)
+                return 1;
+
+        /* Set up the share count now, so that taking a snapshot only
+         * ever increments it */
+        if (buffer->layout_share == NULL) {
+                buffer->layout_share = buf_malloc(buffer, sizeof(CSV_SHARE));
+                if (buffer->layout_share == NULL)
+                        return 1;
+                CSV_REF_INIT(buffer->layout_share->refs, 1);
+        }
+
+        if (buffer->rows < buffer->capacity && buffer->rows > 0) {
+                size_t *width = buf_realloc(buffer, buffer->width,
+                                buffer->rows * sizeof(size_t));
+                if (width != NULL) {
+                        buffer->width = width;
+                        buffer->capacity = buffer->rows;
+                }
+        }
+
+        buffer->frozen = 1;
+        return 0;
+}
+
+CSV_BUFFER *csv_snapshot(CSV_BUFFER *buffer)
+{
+        CSV_BUFFER *copy = csv_create_buffer_alloc(&buffer->alloc);
+        if (copy == NULL)
+                return NULL;
+
+        size_t rows = buffer->rows;
+        copy->field_delim = buffer->field_delim;
+        copy->text_delim = buffer->text_delim;
+        copy->arena = buffer->arena ? CSV_ARENA_CHUNK : 0;
+        copy->width = buf_malloc(copy, (rows ? rows : 1) * sizeof(size_t));
+        if (copy->width == NULL)
+                goto fail;
+        if (rows > 0)
+                memcpy(copy->width, buffer->width, rows * sizeof(size_t));
+        copy->capacity = rows;
+
+        if (buffer->grid != NULL || buffer->column != NULL) {
+                if (buffer->layout_share == NULL) {
+                        buffer->layout_share = buf_malloc(buffer, sizeof(CSV_SHARE));
+                        if (buffer->layout_share == NULL)
+                                goto fail;
+                        CSV_REF_INIT(buffer->layout_share->refs, 1);
+                }
+                CSV_REF_INC(buffer->layout_share->refs);
+                copy->layout_share = buffer->layout_share;
+                copy->grid = buffer->grid;
+                copy->column = buffer->column;
+                copy->columns = buffer->columns;
+                copy->rows = rows;
+                return copy;
+        }
+
+        /* The snapshot gets a store of its own for anything it
+         * allocates, which keeps the original's chunks alive. */
+        if (buffer->store != NULL) {
+                copy->store = buf_malloc(copy, sizeof(CSV_STORE));
+                if (copy->store == NULL)
+                        goto fail;
+                CSV_REF_INIT(copy->store->refs, 1);
+                copy->store->chunks = NULL;
+                copy->store->parent = buffer->store;
+                CSV_REF_INC(buffer->store->refs);
+        }
+
+        size_t capacity = rows ? rows : 1;
+        copy->field = buf_malloc(copy, capacity * sizeof(CSV_FIELD**));
+        copy->row_capacity = buf_malloc(copy, capacity * sizeof(size_t));
+        copy->share = buf_malloc(copy, capacity * sizeof(CSV_SHARE*));
+        if (copy->field == NULL || copy->row_capacity == NULL
+            || copy->share == NULL)
+                goto fail;
+
+        for (size_t i = 0; i < rows; i++) {
+                copy->share[i] = share_row(buffer, i);
+                if (copy->share[i] == NULL)
+                        goto fail;
+                copy->field[i] = buffer->field[i];
+                copy->row_capacity[i] = buffer->row_capacity[i];
+                copy->rows = i + 1;
+        }
 
-int csv_insret_field(CSV_BUFFER *buffer, size_t row, size_t entry,
-        char *field);
+        return copy;
 
-/*
- * Print the CSV buffer as it would appear in a csv file 
-*/
-void print_csv(CSV_BUFFER *buffer);
+fail:
+        csv_destroy_buffer(copy);
+        return NULL;
+}
 
-#endif /* CSV_H_ */
+static bool txn_row(CSV_BUFFER *buffer, size_t row)
+{
+        return buffer->txn != NULL && buffer->share != NULL
+                && buffer->share[row] == &buffer->txn->mark;
+}
 
+static int find_undo(const void *a, const void *b)
+{
+        uintptr_t x = (uintptr_t) ((const CSV_UNDO *) a)->row;
+        uintptr_t y = (uintptr_t) ((const CSV_UNDO *) b)->row;
 
-#ifdef CSV_IMPLEMENTATION
-#include <stdio.h>
-#include <stdbool.h>
-#include <string.h>
+        return x < y ? -1 : x > y;
+}
 
-static int add_char(char **string, int *c, char ch)
+int csv_begin(CSV_BUFFER *buffer)
 {
-        char *tmp = NULL;
-        (*c)++;
-        tmp = realloc(*string, (*c)+1);
-        if (tmp == NULL)
+        if (buffer->txn != NULL)
+                return 2;
+        int layout = csv_get_layout(buffer);
+        if (to_tree(buffer) != 0)
                 return 1;
-        *string = tmp;
-        (*string)[(*c)-1] = ch; 
-        (*string)[*c] = '\0';
 
+        size_t rows = buffer->rows, n = rows ? rows : 1;
+        CSV_TXN *txn = buf_malloc(buffer, sizeof(CSV_TXN));
+        if (txn == NULL)
+                return 1;
+        txn->field = buf_malloc(buffer, n * sizeof(CSV_FIELD**));
+        txn->width = buf_malloc(buffer, n * sizeof(size_t));
+        txn->row_capacity = buf_malloc(buffer, n * sizeof(size_t));
+        txn->share = buf_malloc(buffer, n * sizeof(CSV_SHARE*));
+        txn->log = buf_malloc(buffer, n * sizeof(CSV_UNDO));
+        if (buffer->share == NULL && txn->log != NULL) {
+                size_t capacity = buffer->capacity ? buffer->capacity : 1;
+                buffer->share = buf_malloc(buffer, capacity * sizeof(CSV_SHARE*));
+                for (size_t i = 0; buffer->share != NULL && i < capacity; i++)
+                        buffer->share[i] = NULL;
+        }
+        if (txn->field == NULL || txn->width == NULL || txn->row_capacity == NULL
+            || txn->share == NULL || txn->log == NULL || buffer->share == NULL) {
+                buf_free(buffer, txn->field);
+                buf_free(buffer, txn->width);
+                buf_free(buffer, txn->row_capacity);
+                buf_free(buffer, txn->share);
+                buf_free(buffer, txn->log);
+                buf_free(buffer, txn);
+                return 1;
+        }
+
+        CSV_REF_INIT(txn->mark.refs, 2);
+        txn->rows = rows;
+        txn->logged = 0;
+        txn->layout = layout;
+        for (size_t i = 0; i < rows; i++) {
+                txn->field[i] = buffer->field[i];
+                txn->width[i] = buffer->width[i];
+                txn->row_capacity[i] = buffer->row_capacity[i];
+                if (buffer->share[i] != NULL)
+                        CSV_REF_INC(buffer->share[i]->refs);
+                else
+                        buffer->share[i] = &txn->mark;
+                txn->share[i] = buffer->share[i];
+        }
+        txn->store = buffer->store;
+        if (txn->store != NULL)
+                CSV_REF_INC(txn->store->refs);
+
+        buffer->txn = txn;
         return 0;
 }
 
-static CSV_FIELD *create_field()
+int csv_commit(CSV_BUFFER *buffer)
 {
-        CSV_FIELD *field = CSV_MALLOC(sizeof(CSV_FIELD));
-        field->length = 0;
-        field->text = NULL;
-        set_field(field, "\0");
-        return field;
+        CSV_TXN *txn = buffer->txn;
+        if (txn == NULL)
+                return 2;
+        buffer->txn = NULL;
+
+        /* Rows untouched since csv_begin are the buffer's alone again */
+        for (size_t i = 0; buffer->share != NULL && i < buffer->rows; i++)
+                if (buffer->share[i] == &txn->mark)
+                        buffer->share[i] = NULL;
+
+        /* Drop the transaction's hold on everything else */
+        for (size_t k = 0; k < txn->rows; k++) {
+                CSV_SHARE *share = txn->share[k];
+                if (share == &txn->mark || CSV_REF_DEC(share->refs) != 0)
+                        continue;
+                buf_free(buffer, share);
+                destroy_row(buffer, txn->field[k], txn->width[k]);
+        }
+        for (size_t k = 0; k < txn->logged; k++) {
+                CSV_UNDO *undo = &txn->log[k];
+                if (undo->share != NULL) {
+                        if (CSV_REF_DEC(undo->share->refs) != 0)
+                                continue;
+                        buf_free(buffer, undo->share);
+                }
+                destroy_row(buffer, undo->row, undo->width);
+        }
+        release_store(buffer, txn->store);
+
+        buf_free(buffer, txn->field);
+        buf_free(buffer, txn->width);
+        buf_free(buffer, txn->row_capacity);
+        buf_free(buffer, txn->share);
+        buf_free(buffer, txn->log);
+        buf_free(buffer, txn);
+        return 0;
 }
 
-static void destroy_field(CSV_FIELD *field)
+int csv_rollback(CSV_BUFFER *buffer)
 {
-        if (field->text != NULL) {
-                free(field->text);
-                field->text = NULL;
+        CSV_TXN *txn = buffer->txn;
+        if (txn == NULL)
+                return 2;
+        buffer->txn = NULL;
+
+        /* Let go of everything but the rows the transaction holds */
+        for (size_t i = 0; buffer->field != NULL && i < buffer->rows; i++) {
+                if (buffer->share != NULL && buffer->share[i] == &txn->mark)
+                        buffer->share[i] = NULL;
+                else
+                        release_row(buffer, i);
+        }
+        buffer->rows = 0;
+        free_layout(buffer);
+        buf_free(buffer, buffer->width);
+
+        /* Rows shared since csv_begin keep their share count, which
+         * the transaction's hold passes on to the buffer */
+        qsort(txn->log, txn->logged, sizeof(CSV_UNDO), find_undo);
+        for (size_t k = 0; k < txn->rows; k++) {
+                if (txn->share[k] != &txn->mark)
+                        continue;
+                CSV_UNDO key = { txn->field[k], 0, NULL }, *undo = NULL;
+                if (txn->logged > 0)
+                        undo = bsearch(&key, txn->log, txn->logged,
+                                        sizeof(CSV_UNDO), find_undo);
+                txn->share[k] = undo != NULL ? undo->share : NULL;
         }
-        free(field);
-        field = NULL;
-} 
 
-static int set_field(CSV_FIELD *field, char *text)
-{
-        
-        char *tmp;
+        buffer->field = txn->field;
+        buffer->width = txn->width;
+        buffer->row_capacity = txn->row_capacity;
+        buffer->share = txn->share;
+        buffer->rows = txn->rows;
+        buffer->capacity = txn->rows ? txn->rows : 1;
+        buffer->store = txn->store;
+
+        int layout = txn->layout;
+        buf_free(buffer, txn->log);
+        buf_free(buffer, txn);
+        return csv_set_layout(buffer, layout) == 0 ? 0 : 1;
+}
 
-        field->length = strlen(text) + 1;
-        tmp = realloc(field->text, field->length);
-        if (tmp == NULL)
+int csv_reserve_rows(CSV_BUFFER *buffer, size_t rows)
+{
+        if (to_tree(buffer) != 0)
                 return 1;
-        field->text = tmp;
-        strcpy(field->text, text);
 
-        return 0;
+        return grow_rows(buffer, rows);
 }
 
-static int read_next_field(FILE *fp,
-                char field_delim, char text_delim, 
-                CSV_FIELD *field)
+int csv_reserve_fields(CSV_BUFFER *buffer, size_t row, size_t fields)
 {
+        if (row >= buffer->rows)
+                return 2;
+        if (to_tree(buffer) != 0)
+                return 1;
 
-        char ch = 'a';
-
-        bool done = false;
-        bool in_text = false;
-        bool esc = false;
+        return grow_row(buffer, row, fields);
+}
 
-        int c = 0;
-        char *tmp = CSV_MALLOC(1);
-        tmp[0] = '\0';
-        while (!done) {
-                ch = getc(fp);
+int csv_use_arena(CSV_BUFFER *buffer, size_t chunk_size)
+{
+        if (buffer->rows != 0 || buffer->frozen || buffer->txn != NULL)
+                return 1;
 
-                if (ch == EOF) {
-                        c = 0;
-                        done = true;
-                } else if (!in_text) {
-                        if (ch == text_delim) {
-                                in_text = true;
-                                c = 0;
-                        } else if (ch == field_delim) {
-                                done = true; 
-                        } else if (ch == '\n') {
-                                done = true;
-                        } else { 
-                               add_char(&tmp, &c, ch);
-                        }  
-                } else { /* in_text == true */
-                        if (esc) {
-                                if (ch == text_delim) {
-                                        add_char(&tmp, &c, ch);
-                                        esc = false;
-                                } else {
-                                        esc = false;
-                                        done = true;
-                                }
-                        } else { /* !esc */
-                                if (ch == text_delim) {
-                                        esc = true;
-                                } else if (ch == field_delim) {
-                                        add_char(&tmp, &c, ch);
-                                } else {
-                                        add_char(&tmp, &c, ch);
-                                }
-                        }
-                }
-        } 
-        if (field != NULL){
-                set_field(field, tmp);
-         }
+        buffer->arena = chunk_size ? chunk_size : CSV_ARENA_CHUNK;
+        return 0;
+}
 
-        if (tmp != NULL)
-                free(tmp);
-        tmp = NULL;
+int csv_set_layout(CSV_BUFFER *buffer, int layout)
+{
+        if (layout == csv_get_layout(buffer))
+                return 0;
+        if (buffer->frozen)
+                return 1;
 
-        /* Moving the fp to the beginning of the next field and peeking 
-         * to see if it is a new line or if there is in fact no next field.
-         */
-        fpos_t pos;
-        int retval;
-        done = false;
-        while (!done) {
-                if (ch == field_delim) {
-                        retval = 0;
-                        done = true;
-                }
-                else if (ch == '\n') {
-                        /* Checking to see if this \n is the one that UNIX
-                         * sometimes includes before the EOF */
-                        fgetpos(fp, &pos);
-                        ch = getc(fp);
-                        if (ch == EOF)
-                                retval = 2;
-                        else
-                                retval = 1;
-                        fsetpos(fp, &pos);
-                        done = true;
-                }
-                else if (ch == EOF) {
-                        retval = 2;
-                        done = true;
-                } else {
-                        ch = getc(fp);
-                }
+        switch (layout) {
+        case CSV_LAYOUT_TREE:
+                return to_tree(buffer);
+        case CSV_LAYOUT_ROWS:
+                return to_rows(buffer);
+        case CSV_LAYOUT_COLUMNS:
+                return to_columns(buffer);
+        default:
+                return 2;
         }
-
-        return retval;
 }
 
-static int append_field(CSV_BUFFER *buffer, size_t row)
+int csv_get_layout(CSV_BUFFER *buffer)
 {
+        if (buffer->grid != NULL)
+                return CSV_LAYOUT_ROWS;
+        if (buffer->column != NULL)
+                return CSV_LAYOUT_COLUMNS;
+        return CSV_LAYOUT_TREE;
+}
 
-        CSV_FIELD **temp_field;
+char *csv_entry(CSV_BUFFER *buffer, size_t row, size_t entry)
+{
+        return cell_text(buffer, row, entry, NULL);
+}
 
-        if (buffer->rows < row + 1)
-                return 1;
+uint32_t csv_get_code(CSV_BUFFER *buffer, size_t row, size_t entry)
+{
+        if (buffer->column == NULL || row >= buffer->rows
+            || entry >= buffer->width[row]
+            || buffer->column[entry].code == NULL)
+                return CSV_NO_CODE;
 
-        /* Set col equal to the index of the new field */
-        int col = buffer->width[row];
+        return buffer->column[entry].code[row];
+}
 
-        temp_field = realloc(buffer->field[row], 
-                        (col + 1) * sizeof(CSV_FIELD*));
-        if (temp_field == NULL) {
-                return 2;
-        } else {
-                buffer->field[row] = temp_field;
-                buffer->field[row][col] = create_field(); 
-                buffer->width[row]++;
-        } 
+uint32_t csv_find_code(CSV_BUFFER *buffer, size_t entry, const char *text)
+{
+        if (buffer->column == NULL || entry >= buffer->columns
+            || buffer->column[entry].code == NULL)
+                return CSV_NO_CODE;
+
+        CSV_COLUMN *column = &buffer->column[entry];
+        size_t length = strlen(text) + 1;
+        for (size_t k = 0; k < column->distinct; k++) {
+                if (column->cell[k].length == length
+                    && memcmp(column->text + column->cell[k].offset,
+                              text, length) == 0)
+                        return k;
+        }
 
-        return 0;
+        return CSV_NO_CODE;
 }
 
-static int append_row(CSV_BUFFER *buffer)
+size_t csv_get_distinct(CSV_BUFFER *buffer, size_t entry)
 {
-        size_t *temp_width;
-        CSV_FIELD ***temp_field;
+        if (buffer->column == NULL || entry >= buffer->columns)
+                return 0;
 
-        size_t row  = buffer->rows;
+        return buffer->column[entry].distinct;
+}
 
-        temp_width = realloc(buffer->width, (buffer->rows + 1) * 
-                        sizeof(size_t));
-        if (temp_width != NULL) { 
-                buffer->width = temp_width;
-                buffer->width[row] = 0;
-        } else {
-                return 1;
+static CSV_FIELD **pack_row(CSV_BUFFER *buffer, const CSV_VIEW *fields,
+                size_t n)
+{
+        size_t width = n ? n : 1, text = 0;
+        for (size_t j = 0; j < n; j++)
+                if (fields[j].length + 1 > CSV_SMALL_TEXT)
+                        text += fields[j].length + 1;
+
+        CSV_FIELD **cells = buf_malloc(buffer, width * sizeof(CSV_FIELD*));
+        if (cells == NULL)
+                return NULL;
+
+        /* A block outside an arena would outlive the row, so each
+         * cell is its own allocation there */
+        if (!buffer->arena) {
+                for (size_t j = 0; j < width; j++) {
+                        cells[j] = create_field(buffer);
+                        if (cells[j] == NULL
+                            || (j < n && fields[j].length > 0
+                                && set_field_n(buffer, cells[j], fields[j].text,
+                                        fields[j].length) != 0)) {
+                                destroy_row(buffer, cells,
+                                                cells[j] == NULL ? j : j + 1);
+                                return NULL;
+                        }
+                }
+                return cells;
         }
 
-        temp_field = realloc(buffer->field, (buffer->rows + 1) * 
-                        sizeof(CSV_FIELD**));
-        if (temp_field != NULL) {
-                buffer->field = temp_field;
-                buffer->field[row] = NULL;
+        CSV_FIELD *cell = arena_alloc(buffer, width * sizeof(CSV_FIELD) + text,
+                        sizeof(((CSV_CHUNK *) 0)->data[0]));
+        if (cell == NULL) {
+                buf_free(buffer, cells);
+                return NULL;
         }
-        else {
-                free(temp_width);
-                return 2;
+
+        char *dest = (char *) (cell + width);
+        for (size_t j = 0; j < width; j++, cell++) {
+                size_t length = j < n ? fields[j].length : 0;
+                char *to = length + 1 <= CSV_SMALL_TEXT ? cell->small : dest;
+                if (length > 0)
+                        memcpy(to, fields[j].text, length);
+                to[length] = '\0';
+                cell->text = to;
+                cell->length = length + 1;
+                cell->flags = CSV_FIELD_BORROWED;
+                if (to == dest) {
+                        cell->flags |= CSV_TEXT_BORROWED;
+                        dest += length + 1;
+                }
+                cells[j] = cell;
         }
 
-        buffer->rows++;
-        append_field(buffer, row);
-        return 0;
+        return cells;
 }
 
-static int remove_last_field(CSV_BUFFER *buffer, size_t row)
+int csv_append_row(CSV_BUFFER *buffer, const CSV_VIEW *fields, size_t n)
 {
+        if (to_tree(buffer) != 0)
+                return 1;
 
-        size_t entry = buffer->width[row] - 1;
-
-        CSV_FIELD **temp_row;
-
-        /* If there are no entries in the row there is nothing to
-         * remove, but return success because this is expected */
-        if (row > buffer->rows - 1) 
-                return 0;
-        /* If t he row exists, but has no fields, something went
-         * wrong; every row in the scope should have at least one
-         * field. 
-         */
-        else if (buffer->width[row] == 0)
+        size_t row = buffer->rows;
+        if (row == buffer->capacity
+            && grow_rows(buffer, row < 4 ? 8 : 2 * row) != 0)
                 return 1;
-        /* If there is only one entry left, just clear it. If the 
-         * caller wants to remove the row, she will call
-         * csv_remove_row.
-         */
-        else if (buffer->width[row] == 1) {
-                csv_clear_field(buffer, row, 0);
-                return 0;
-        }
-        /* Otherwise destroy the final field and decrement the width */
-        else {
-                destroy_field(buffer->field[row][entry]);
-                temp_row = realloc(buffer->field[row], entry
-                                * sizeof (CSV_FIELD*));
-                if (temp_row != NULL)
-                        buffer->field[row] = temp_row;
-                else
-                        return 3; 
-                buffer->width[row]--;
-        }
+        CSV_FIELD **cells = pack_row(buffer, fields, n);
+        if (cells == NULL)
+                return 1;
+
+        buffer->field[row] = cells;
+        buffer->width[row] = n ? n : 1;
+        buffer->row_capacity[row] = n ? n : 1;
+        if (buffer->share != NULL)
+                buffer->share[row] = NULL;
+        buffer->rows++;
 
         return 0;
 }
 
-static int remove_last_row(CSV_BUFFER *buffer)
+int csv_insert_rows(CSV_BUFFER *buffer, size_t at,
+                CSV_BUFFER *src, size_t src_first, size_t count)
 {
+        if (src_first > src->rows || count > src->rows - src_first)
+                return 2;
+        if (count == 0)
+                return 0;
+        if (to_tree(buffer) != 0)
+                return 1;
+
+        /* Everything that can fail happens before the gap is opened */
+        while (buffer->rows < at) {
+                if (append_row(buffer) != 0)
+                        return 1;
+        }
+        size_t rows = buffer->rows;
+        if (rows + count > buffer->capacity
+            && grow_rows(buffer, rows + count > 2 * buffer->capacity ?
+                            rows + count : 2 * buffer->capacity) != 0)
+                return 1;
 
-        int row = buffer->rows - 1;
-        int entry = buffer->width[row] - 1;
+        size_t widest = 0;
+        for (size_t k = 0; k < count; k++)
+                if (src->width[src_first + k] > widest)
+                        widest = src->width[src_first + k];
+
+        struct {
+                CSV_FIELD **field;
+                size_t width;
+                size_t capacity;
+                CSV_SHARE *share;
+        } *slot = buf_malloc(buffer, count * sizeof(*slot));
+        CSV_VIEW *view = buf_malloc(buffer, widest * sizeof(CSV_VIEW));
+        if (slot == NULL || view == NULL) {
+                buf_free(buffer, slot);
+                buf_free(buffer, view);
+                return 1;
+        }
 
-        CSV_FIELD ***temp_field = NULL;
-        size_t *temp_width = NULL;
+        bool shareable = src->field != NULL && (src == buffer
+                || (!buffer->arena && !src->arena && same_allocator(buffer, src)));
+        if (shareable && buffer->share == NULL) {
+                buffer->share = buf_malloc(buffer, buffer->capacity
+                                * sizeof(CSV_SHARE*));
+                if (buffer->share == NULL) {
+                        buf_free(buffer, slot);
+                        buf_free(buffer, view);
+                        return 1;
+                }
+                for (size_t i = 0; i < buffer->capacity; i++)
+                        buffer->share[i] = NULL;
+        }
 
-        while (entry >= 0) {
-                remove_last_field(buffer, row);
-                entry--;
-        } 
+        size_t k;
+        for (k = 0; k < count; k++) {
+                size_t i = src_first + k, w = src->width[i], j = 0;
+                while (shareable && src != buffer && j < w
+                       && owned_field(src->field[i][j]))
+                        j++;
+                slot[k].width = w;
+                if (shareable && (src == buffer || j == w)) {
+                        slot[k].share = share_row(src, i);
+                        if (slot[k].share == NULL)
+                                break;
+                        slot[k].field = src->field[i];
+                        slot[k].capacity = src->row_capacity[i];
+                        continue;
+                }
 
-        temp_field = realloc(buffer->field, (buffer->rows - 1) *
-                        sizeof(CSV_FIELD**));
-        temp_width = realloc(buffer->width, (buffer->rows - 1) *
-                        sizeof(size_t)); 
-        if (temp_width == NULL || temp_field == NULL)
+                for (j = 0; j < w; j++) {
+                        size_t length;
+                        view[j].text = cell_text(src, i, j, &length);
+                        view[j].length = length - 1;
+                }
+                slot[k].share = NULL;
+                slot[k].field = pack_row(buffer, view, w);
+                if (slot[k].field == NULL)
+                        break;
+                slot[k].capacity = w;
+        }
+        if (k != count) {
+                while (k-- > 0) {
+                        if (slot[k].share != NULL)
+                                (void) CSV_REF_DEC(slot[k].share->refs);
+                        else
+                                destroy_row(buffer, slot[k].field,
+                                                slot[k].width);
+                }
+                buf_free(buffer, slot);
+                buf_free(buffer, view);
                 return 1;
+        }
 
-        buffer->field = temp_field;
-        buffer->width = temp_width;
-        buffer->rows--;
+        move_rows(buffer, at + count, at, rows - at);
+        for (k = 0; k < count; k++) {
+                buffer->field[at + k] = slot[k].field;
+                buffer->width[at + k] = slot[k].width;
+                buffer->row_capacity[at + k] = slot[k].capacity;
+                if (buffer->share != NULL)
+                        buffer->share[at + k] = slot[k].share;
+        }
+        buffer->rows += count;
 
+        buf_free(buffer, slot);
+        buf_free(buffer, view);
         return 0;
 }
 
-CSV_BUFFER *csv_create_buffer()
+static bool merge_store(CSV_BUFFER *dest, CSV_BUFFER *src, bool commit)
 {
+        CSV_STORE *store = src->store;
 
-        CSV_BUFFER *buffer = CSV_MALLOC(sizeof(CSV_BUFFER));
-
-        if (buffer != NULL) {
-                buffer->field = NULL;
-                buffer->rows = 0;
-                buffer->width = NULL;
-                buffer->field_delim = ',';
-                buffer->text_delim = '"';
+        if (store == NULL || dest->store == NULL) {
+                if (commit && store != NULL) {
+                        dest->store = store;
+                        src->store = NULL;
+                }
+                return true;
         }
-
-        return buffer;
+        if (CSV_REF_GET(store->refs) != 1 || store->parent != NULL)
+                return false;
+        if (!commit)
+                return true;
+
+        /* dest keeps allocating from the chunk at its head */
+        CSV_CHUNK *last = store->chunks;
+        if (last != NULL) {
+                while (last->next != NULL)
+                        last = last->next;
+                if (dest->store->chunks == NULL) {
+                        dest->store->chunks = store->chunks;
+                } else {
+                        last->next = dest->store->chunks->next;
+                        dest->store->chunks->next = store->chunks;
+                }
+        }
+        buf_free(src, store);
+        src->store = NULL;
+        return true;
 }
 
-void csv_destroy_buffer(CSV_BUFFER *buffer)
+int csv_splice(CSV_BUFFER *dest, size_t at, CSV_BUFFER *src,
+                bool take_ownership)
 {
+        if (src == dest || !take_ownership)
+                return csv_insert_rows(dest, at, src, 0, src->rows);
+        if (src->frozen || to_tree(dest) != 0)
+                return 1;
 
-        for (size_t i = 0; i < buffer->rows; i++) {
-                for (size_t j = 0; j < buffer->width[i]; j++) {
-                        destroy_field(buffer->field[i][j]);
+        size_t count = src->rows;
+        bool whole = src->field != NULL && src->txn == NULL
+                && same_allocator(dest, src) && (!dest->arena || src->arena);
+
+        /* Everything that can fail happens before any row moves.
+         * Padding an arena dest may give it a store, so whether src's
+         * chunks can change hands is only decided afterwards. */
+        size_t rows = dest->rows;
+        if (whole && count > 0) {
+                while (dest->rows < at) {
+                        if (append_row(dest) != 0)
+                                return 1;
                 }
-                free(buffer->field[i]);
-                buffer->field[i] = NULL;
+                rows = dest->rows;
+                if (rows + count > dest->capacity
+                    && grow_rows(dest, rows + count > 2 * dest->capacity ?
+                                    rows + count : 2 * dest->capacity) != 0)
+                        return 1;
+                if (src->share != NULL && dest->share == NULL) {
+                        dest->share = buf_malloc(dest, dest->capacity * sizeof(CSV_SHARE*));
+                        if (dest->share == NULL)
+                                return 1;
+                        for (size_t i = 0; i < rows; i++)
+                                dest->share[i] = NULL;
+                }
+        }
+        if (!whole || !merge_store(dest, src, false)) {
+                if (csv_insert_rows(dest, at, src, 0, count) != 0)
+                        return 1;
+                free_layout(src);
+                src->rows = 0;
+                src->capacity = 0;
+                return 0;
+        }
+        if (count == 0) {
+                merge_store(dest, src, true);
+                return 0;
         }
 
-        if (buffer->field != NULL)
-                free(buffer->field);
+        move_rows(dest, at + count, at, rows - at);
+        memcpy(dest->field + at, src->field, count * sizeof(CSV_FIELD**));
+        memcpy(dest->width + at, src->width, count * sizeof(size_t));
+        memcpy(dest->row_capacity + at, src->row_capacity, count * sizeof(size_t));
+        for (size_t i = 0; dest->share != NULL && i < count; i++)
+                dest->share[at + i] = src->share != NULL ? src->share[i] : NULL;
+        dest->rows += count;
 
-        if (buffer->width != NULL)
-                free(buffer->width);
+        src->rows = 0;
+        merge_store(dest, src, true);
+        return 0;
+}
 
-        free(buffer);
+int csv_append_buffer(CSV_BUFFER *dest, CSV_BUFFER *src,
+                bool take_ownership)
+{
+        return csv_splice(dest, dest->rows, src, take_ownership);
 }
 
 int csv_load(CSV_BUFFER *buffer, char *file_name)
@@ -620,6 +3344,12 @@ int csv_load(CSV_BUFFER *buffer, char *file_name)
         if (fp == NULL)
                 return 1;
 
+        int layout = csv_get_layout(buffer);
+        if (to_tree(buffer) != 0) {
+                fclose(fp);
+                return 2;
+        }
+
         int next = 1;
         bool end = false;
         bool first = true;
@@ -628,8 +3358,7 @@ int csv_load(CSV_BUFFER *buffer, char *file_name)
         while (!end) {
 
                 if (!first) {
-                        next = read_next_field(fp, 
-                                        buffer->field_delim, buffer->text_delim,
+                        next = read_next_field(fp, buffer,
                                         buffer->field[i][j-1]);
                 }
 
@@ -641,6 +3370,8 @@ int csv_load(CSV_BUFFER *buffer, char *file_name)
                                 return 2;
                         j = 1;
                         i++;
+                        if (own_row(buffer, i) != 0)
+                                return 2;
                 }
 
                 if (next == 0) {
@@ -654,7 +3385,132 @@ int csv_load(CSV_BUFFER *buffer, char *file_name)
         }
 
         fclose(fp);
-        return 0;
+        return csv_set_layout(buffer, layout) == 0 ? 0 : 2;
+}
+
+int csv_load_exact(CSV_BUFFER *buffer, char *file_name)
+{
+
+        if (buffer->rows != 0)
+                return 3;
+        FILE *fp = fopen(file_name, "r");
+        if (fp == NULL)
+                return 1;
+
+        int layout = csv_get_layout(buffer);
+        if (to_tree(buffer) != 0) {
+                fclose(fp);
+                return 2;
+        }
+
+        size_t rows = 0, cap = 0, cells = 0, text = 0, length;
+        size_t *width = NULL, *tmp_width, *row_capacity = NULL;
+        CSV_FIELD ***field = NULL;
+        CSV_CHUNK *chunk = NULL;
+        int next = 1;
+
+        /* First pass: measure the grid and the decoded text. The
+         * width array grows geometrically and is trimmed afterwards. */
+        do {
+                if (next == 1) {
+                        if (rows == cap) {
+                                cap = cap ? cap * 2 : 64;
+                                tmp_width = buf_realloc(buffer, width, cap * sizeof(size_t));
+                                if (tmp_width == NULL)
+                                        goto fail;
+                                width = tmp_width;
+                        }
+                        width[rows++] = 0;
+                }
+                next = scan_field(fp, buffer->field_delim,
+                                buffer->text_delim, NULL, 0, &length);
+                width[rows-1]++;
+                cells++;
+                if (length + 1 > CSV_SMALL_TEXT)
+                        text += length + 1;
+        } while (next != 2);
+
+        tmp_width = buf_realloc(buffer, width, rows * sizeof(size_t));
+        if (tmp_width != NULL)
+                width = tmp_width;
+
+        /* Second pass: decode into one chunk holding every field
+         * followed by all of the text. */
+        field = alloc_rows(buffer, rows, rows, width, &row_capacity);
+        if (field == NULL)
+                goto fail;
+        chunk = add_chunk(buffer, cells * sizeof(CSV_FIELD) + text
+                        + CSV_SMALL_TEXT);
+        if (chunk == NULL)
+                goto fail;
+        chunk->used = chunk->size;
+
+        CSV_FIELD *cell = (CSV_FIELD *) chunk->data;
+        char *dest = (char *) (cell + cells);
+        char *end = dest + text + CSV_SMALL_TEXT;
+
+        rewind(fp);
+        for (size_t i = 0; i < rows; i++) {
+                for (size_t j = 0; j < width[i]; j++) {
+                        next = scan_field(fp, buffer->field_delim,
+                                        buffer->text_delim, dest, end - dest, &length);
+                        /* The file changed under us */
+                        if (length + 1 > (size_t) (end - dest)
+                            || next != (j + 1 < width[i] ? 0 : (i + 1 < rows ? 1 : 2)))
+                                goto fail;
+                        place_text(cell, &dest, length + 1);
+                        field[i][j] = cell++;
+                }
+        }
+
+        fclose(fp);
+        buf_free(buffer, buffer->field);
+        buf_free(buffer, buffer->width);
+        buf_free(buffer, buffer->row_capacity);
+        buf_free(buffer, buffer->share);
+        buffer->share = NULL;
+        buffer->field = field;
+        buffer->width = width;
+        buffer->capacity = rows;
+        buffer->row_capacity = row_capacity;
+        buffer->rows = rows;
+        return csv_set_layout(buffer, layout) == 0 ? 0 : 2;
+
+fail:
+        fclose(fp);
+        if (field != NULL) {
+                for (size_t i = 0; i < rows; i++)
+                        buf_free(buffer, field[i]);
+                buf_free(buffer, field);
+                buf_free(buffer, row_capacity);
+        }
+        buf_free(buffer, width);
+        if (chunk != NULL) {
+                buffer->store->chunks = chunk->next;
+                buf_free(buffer, chunk);
+        }
+        return 2;
+}
+
+static void flush_bytes(CSV_WRITER *out)
+{
+        if (out->used > 0 && fwrite(out->data, 1, out->used, out->fp) != out->used)
+                out->error = 1;
+        out->used = 0;
+}
+
+static void write_bytes(CSV_WRITER *out, const char *data, size_t size)
+{
+        if (size > out->size - out->used) {
+                flush_bytes(out);
+                if (size >= out->size) {
+                        if (fwrite(data, 1, size, out->fp) != size)
+                                out->error = 1;
+                        return;
+                }
+        }
+        memcpy(out->data + out->used, data, size);
+        out->used += size;
 }
 
 int csv_save(char *file_name, CSV_BUFFER *buffer)
@@ -664,42 +3520,64 @@ int csv_save(char *file_name, CSV_BUFFER *buffer)
         FILE *fp = fopen(file_name, "w");
         if (fp == NULL)
                 return 1;
+
+        /* Output is formatted into one large block, so stdio's own
+         * buffering would only add a copy */
+        char fallback[BUFSIZ];
+        CSV_WRITER out = { fp, buf_malloc(buffer, CSV_SAVE_BLOCK),
+                CSV_SAVE_BLOCK, 0, 0 };
+        if (out.data == NULL) {
+                out.data = fallback;
+                out.size = sizeof(fallback);
+        }
+        setvbuf(fp, NULL, _IONBF, 0);
+
         char text_delim = buffer->text_delim;
         char field_delim = buffer->field_delim;
-        for(size_t i = 0; i < buffer->rows; i++) {
+        char *text;
+        size_t length;
+        for(size_t i = 0; i < buffer->rows && !out.error; i++) {
                 for(size_t j = 0; j < buffer->width[i]; j++) {
-                        chloc = strchr(buffer->field[i][j]->text, text_delim);
+                        text = cell_text(buffer, i, j, &length);
+                        chloc = memchr(text, text_delim, length - 1);
                         if(chloc == NULL)
-                                chloc = strchr(buffer->field[i][j]->text, field_delim);
+                                chloc = memchr(text, field_delim, length - 1);
                         if(chloc == NULL)
-                                chloc = strchr(buffer->field[i][j]->text, '\n');
+                                chloc = memchr(text, '\n', length - 1);
                         /* if any of the above characters are found, chloc will be set
                          * and we must use text deliminators.
                          */
                         if(chloc != NULL) {
-                                fputc(text_delim, fp);
-                                for(size_t k = 0; k < buffer->field[i][j]->length - 1; k++) {
-                                        /* if there are any text delims in the string,
-                                         * we must escape them.
-                                         */
-                                        if(buffer->field[i][j]->text[k] == text_delim)
-                                                fputc(text_delim, fp);
-                                        fputc(buffer->field[i][j]->text[k], fp);
+                                write_bytes(&out, &text_delim, 1);
+                                /* if there are any text delims in the string,
+                                 * we must escape them: each run up to and
+                                 * including one is copied, then the delim
+                                 * is written again.
+                                 */
+                                char *end = text + length - 1;
+                                while ((chloc = memchr(text, text_delim, end - text)) != NULL) {
+                                        write_bytes(&out, text, chloc - text + 1);
+                                        write_bytes(&out, &text_delim, 1);
+                                        text = chloc + 1;
                                 }
-                                fputc(text_delim, fp);
-                                chloc = NULL;
+                                write_bytes(&out, text, end - text);
+                                write_bytes(&out, &text_delim, 1);
                         } else {
-                                fputs(buffer->field[i][j]->text, fp);
+                                write_bytes(&out, text, length - 1);
                         }
                         if(j < buffer->width[i] - 1)
-                                fputc(field_delim, fp);
+                                write_bytes(&out, &field_delim, 1);
                         else if (i < buffer->rows - 1)
-                                fputc('\n', fp);
+                                write_bytes(&out, "\n", 1);
                 }
         }
 
-        fclose(fp);
-        return 0;
+        flush_bytes(&out);
+        if (out.data != fallback)
+                buf_free(buffer, out.data);
+        if (fclose(fp) != 0)
+                out.error = 1;
+        return out.error;
 }
 
 int csv_get_field(char *dest, size_t dest_len, 
@@ -718,18 +3596,23 @@ int csv_get_field(char *dest, size_t dest_len,
                  * with the case of an empty entry.
                  */
                 return 2;
-        } else {
+        }
+
+        size_t length;
+        char *text = cell_text(src, row, entry, &length);
 
         /* If destination is not large enough to hold the whole entry,
-         * strncpy will truncate it for us. 
+         * it is truncated; the rest is padded with '\0' like strncpy,
+         * but text after an embedded '\0' is still copied. 
          */
-                strncpy(dest, src->field[row][entry]->text, dest_len);
-                dest[dest_len] = '\0';
-        }
+        size_t copied = length - 1 < dest_len ? length - 1 : dest_len;
+        memcpy(dest, text, copied);
+        memset(dest + copied, '\0', dest_len - copied);
+        dest[dest_len] = '\0';
 
-        if (src->field[row][entry]->length > dest_len + 1)
+        if (length > dest_len + 1)
                 return 1;
-        if (src->field[row][entry]->length == 0)
+        if (length == 0)
                 return 2;
         else         
                 return 0;
@@ -738,8 +3621,13 @@ int csv_get_field(char *dest, size_t dest_len,
 int csv_copy_field(CSV_BUFFER *dest, int dest_row, int dest_entry,
                    CSV_BUFFER *source, int source_row, int source_entry)
 {
-        return set_field(dest->field[dest_row][dest_entry],
-                        source->field[source_row][source_entry]->text);
+        if (to_tree(dest) != 0 || own_row(dest, dest_row) != 0)
+                return 1;
+
+        size_t length;
+        char *text = cell_text(source, source_row, source_entry, &length);
+        return set_field_n(dest, dest->field[dest_row][dest_entry],
+                        text, length - 1);
 }
 
 int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry)
@@ -747,13 +3635,15 @@ int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry)
         /* Field is already clear (out of range) */
         if (buffer->rows < row + 1 || buffer->width[row] < entry + 1)
                 return 0;
+        if (to_tree(buffer) != 0 || own_row(buffer, row) != 0)
+                return 1;
 
         /* Destroy the field if it is last in the row (and now field 0) */ 
         if (entry == buffer->width[row] - 1 && entry != 0)
                 remove_last_field(buffer, row);
 
         else
-               set_field(buffer->field[row][entry], "\0");
+               set_field(buffer, buffer->field[row][entry], "\0");
 
         return 0; 
 }
@@ -761,7 +3651,8 @@ int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry)
 int csv_clear_row(CSV_BUFFER *buffer, size_t row)
 {
 
-        CSV_FIELD **temp_row;
+        if (to_tree(buffer) != 0)
+                return 1;
 
         /* If the requested field is the last one, simply remove it. */
         if (row == buffer->rows-1) {
@@ -771,24 +3662,15 @@ int csv_clear_row(CSV_BUFFER *buffer, size_t row)
                         return 0;
         }
 
-        /* Destroy every field but the last one */
-        for (size_t i = buffer->width[row] - 1; i > 0; i--) {
-                destroy_field(buffer->field[row][i]);
-        }
-        /* Clear the last field */
-        set_field(buffer->field[row][0], "\0");
-
-        temp_row = realloc(buffer->field[row], sizeof (CSV_FIELD*));
-        /* If it didn't shrink, recreate the destroyed fields */
-        if (temp_row == NULL) { 
-                for (size_t i = 1; i < buffer->width[row]; i++) {
-                        append_field(buffer, row);
-                        set_field(buffer->field[row][i], "\0");
-                }
+        if (own_row(buffer, row) != 0)
                 return 1;
-        } else {
-                buffer->field[row] = temp_row;
+
+        /* Destroy every field but the first one */
+        for (size_t i = buffer->width[row] - 1; i > 0; i--) {
+                destroy_field(buffer, buffer->field[row][i]);
         }
+        /* Clear the first field */
+        set_field(buffer, buffer->field[row][0], "\0");
 
         buffer->width[row] = 1;
 
@@ -803,6 +3685,8 @@ int csv_copy_row(CSV_BUFFER *dest, size_t dest_row,
                 csv_clear_row(dest, dest_row);
                 return 0;
         }
+        if (to_tree(dest) != 0)
+                return 1;
 
         while (dest->rows < (dest_row + 1)) 
                if(append_row(dest) != 0)
@@ -822,28 +3706,248 @@ int csv_copy_row(CSV_BUFFER *dest, size_t dest_row,
         return 0;
 }
 
+static bool same_allocator(CSV_BUFFER *a, CSV_BUFFER *b)
+{
+        return a->alloc.malloc == b->alloc.malloc
+                && a->alloc.realloc == b->alloc.realloc
+                && a->alloc.free == b->alloc.free
+                && a->alloc.ctx == b->alloc.ctx;
+}
+
+static bool owned_field(CSV_FIELD *field)
+{
+        return !(field->flags & (CSV_FIELD_BORROWED | CSV_TEXT_BORROWED));
+}
+
+static CSV_FIELD **take_row(CSV_BUFFER *dest, CSV_BUFFER *src,
+                size_t src_row, size_t *capacity)
+{
+        CSV_FIELD **fields = src->field[src_row];
+        size_t width = src->width[src_row];
+        bool shared = src->share != NULL && src->share[src_row] != NULL;
+        bool steal = !shared && !dest->arena && same_allocator(dest, src);
+
+        /* The whole row array can change hands */
+        size_t j = 0;
+        while (steal && j < width && owned_field(fields[j]))
+                j++;
+        if (dest == src || (steal && j == width)) {
+                *capacity = src->row_capacity[src_row];
+                return fields;
+        }
+
+        CSV_FIELD **copy = buf_malloc(dest, width * sizeof(CSV_FIELD*));
+        if (copy == NULL)
+                return NULL;
+        for (j = 0; j < width; j++) {
+                if (steal && owned_field(fields[j])) {
+                        copy[j] = fields[j];
+                        continue;
+                }
+                copy[j] = create_field(dest);
+                if (copy[j] == NULL
+                    || set_field_n(dest, copy[j], fields[j]->text,
+                                   fields[j]->length - 1) != 0) {
+                        if (copy[j] != NULL)
+                                j++;
+                        while (j-- > 0)
+                                if (copy[j] != fields[j])
+                                        destroy_field(dest, copy[j]);
+                        buf_free(dest, copy);
+                        return NULL;
+                }
+        }
+
+        /* src lets go of everything that was not moved */
+        if (shared) {
+                release_row(src, src_row);
+        } else {
+                for (j = 0; j < width; j++)
+                        if (copy[j] != fields[j])
+                                destroy_field(src, fields[j]);
+                buf_free(src, fields);
+                src->field[src_row] = NULL;
+        }
+        *capacity = width;
+        return copy;
+}
+
+int csv_move_row(CSV_BUFFER *dest, size_t dest_row,
+                CSV_BUFFER *src, size_t src_row)
+{
+        if (src_row >= src->rows)
+                return 2;
+        if (to_tree(src) != 0 || to_tree(dest) != 0)
+                return 1;
+
+        /* Pad dest first, so that nothing can fail once the row has
+         * been taken out of src */
+        size_t height = dest == src ? dest->rows - 1 : dest->rows;
+        while (height < dest_row) {
+                if (append_row(dest) != 0)
+                        return 1;
+                height++;
+        }
+        if (dest != src && dest->rows == dest->capacity
+            && grow_rows(dest, dest->rows < 4 ? 8 : 2 * dest->rows) != 0)
+                return 1;
+
+        size_t capacity;
+        CSV_SHARE *share = src->share != NULL ? src->share[src_row] : NULL;
+        CSV_FIELD **fields = take_row(dest, src, src_row, &capacity);
+        if (fields == NULL)
+                return 1;
+        size_t width = src->width[src_row];
+        if (dest != src)
+                share = NULL;
+
+        move_rows(src, src_row, src_row + 1, src->rows - src_row - 1);
+        src->rows--;
+
+        move_rows(dest, dest_row + 1, dest_row, dest->rows - dest_row);
+        dest->field[dest_row] = fields;
+        dest->width[dest_row] = width;
+        dest->row_capacity[dest_row] = capacity;
+        if (dest->share != NULL)
+                dest->share[dest_row] = share;
+        dest->rows++;
+
+        return 0;
+}
+
+int csv_swap_rows(CSV_BUFFER *buffer, size_t a, size_t b)
+{
+        if (a >= buffer->rows || b >= buffer->rows)
+                return 2;
+        if (to_tree(buffer) != 0)
+                return 1;
+
+        CSV_FIELD **fields = buffer->field[a];
+        buffer->field[a] = buffer->field[b];
+        buffer->field[b] = fields;
+
+        size_t width = buffer->width[a];
+        buffer->width[a] = buffer->width[b];
+        buffer->width[b] = width;
+
+        size_t capacity = buffer->row_capacity[a];
+        buffer->row_capacity[a] = buffer->row_capacity[b];
+        buffer->row_capacity[b] = capacity;
+
+        if (buffer->share != NULL) {
+                CSV_SHARE *share = buffer->share[a];
+                buffer->share[a] = buffer->share[b];
+                buffer->share[b] = share;
+        }
+
+        return 0;
+}
+
+int csv_move_field(CSV_BUFFER *dest, size_t dest_row, size_t dest_entry,
+                CSV_BUFFER *src, size_t src_row, size_t src_entry)
+{
+        if (src_row >= src->rows || src_entry >= src->width[src_row])
+                return 2;
+        if (dest == src && dest_row == src_row && dest_entry == src_entry)
+                return 0;
+        if (to_tree(src) != 0 || own_row(src, src_row) != 0)
+                return 1;
+
+        /* Make sure the dest field exists */
+        if (dest_row >= dest->rows || dest_entry >= dest->width[dest_row]) {
+                if (csv_set_field(dest, dest_row, dest_entry, "") != 0)
+                        return 1;
+        } else if (to_tree(dest) != 0 || own_row(dest, dest_row) != 0) {
+                return 1;
+        }
+
+        CSV_FIELD **from = &src->field[src_row][src_entry];
+        CSV_FIELD **to = &dest->field[dest_row][dest_entry];
+        if (dest == src || (!dest->arena && !src->arena
+                            && same_allocator(dest, src)
+                            && owned_field(*from) && owned_field(*to))) {
+                CSV_FIELD *field = *to;
+                *to = *from;
+                *from = field;
+        } else if (set_field_n(dest, *to, (*from)->text, (*from)->length - 1) != 0) {
+                return 1;
+        }
+
+        return set_field(src, *from, "");
+}
+
 int csv_remove_row(CSV_BUFFER *buffer, size_t row)
 {
 
-        if(row > buffer->rows - 1)
+        if (row >= buffer->rows)
+                return 0;
+        if (to_tree(buffer) != 0)
+                return 1;
+
+        release_row(buffer, row);
+        move_rows(buffer, row, row + 1, buffer->rows - row - 1);
+        buffer->rows--;
+
+        return 0;
+
+}
+
+static int remove_rows(CSV_BUFFER *buffer,
+                int (*pred)(CSV_BUFFER *buffer, size_t row, void *user),
+                void *user, const unsigned char *mask)
+{
+        if (buffer->rows == 0)
                 return 0;
+        if (to_tree(buffer) != 0)
+                return 1;
 
-        for (size_t i = row; i < buffer->rows-1; i++) 
-                csv_copy_row(buffer, i, buffer, i + 1);
-        remove_last_row(buffer);
+        /* Rows before i have been dealt with and kept of them
+         * survived; rows from i on are where they always were. */
+        size_t kept = 0;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                bool reject = pred != NULL ? pred(buffer, i, user) != 0
+                        : (mask[i / 8] >> (i % 8)) & 1;
+                if (reject) {
+                        release_row(buffer, i);
+                } else {
+                        if (kept != i)
+                                move_rows(buffer, kept, i, 1);
+                        kept++;
+                }
+        }
+        buffer->rows = kept;
 
         return 0;
+}
 
+int csv_remove_rows_if(CSV_BUFFER *buffer,
+                int (*pred)(CSV_BUFFER *buffer, size_t row, void *user),
+                void *user)
+{
+        return remove_rows(buffer, pred, user, NULL);
+}
+
+int csv_remove_rows_mask(CSV_BUFFER *buffer, const unsigned char *mask)
+{
+        return remove_rows(buffer, NULL, NULL, mask);
 }
 
 int csv_remove_field(CSV_BUFFER *buffer, size_t row, size_t entry)
 {
-        if (row > buffer->rows - 1 || entry > buffer->width[row] - 1)
+        if (row >= buffer->rows || entry >= buffer->width[row])
                 return 0;
-        
-        for (size_t i = entry; i < buffer->width[row]-1; i++)
-                csv_copy_field(buffer, row, i, buffer, row, i + 1);
-        remove_last_field(buffer, row);
+        if (to_tree(buffer) != 0 || own_row(buffer, row) != 0)
+                return 1;
+
+        size_t width = buffer->width[row];
+        CSV_FIELD **fields = buffer->field[row];
+        if (width == 1)
+                return set_field(buffer, fields[0], "");
+
+        destroy_field(buffer, fields[entry]);
+        memmove(fields + entry, fields + entry + 1,
+                        (width - entry - 1) * sizeof(CSV_FIELD*));
+        buffer->width[row]--;
 
         return 0;
 }
@@ -851,27 +3955,355 @@ int csv_remove_field(CSV_BUFFER *buffer, size_t row, size_t entry)
 
 int csv_remove_col(CSV_BUFFER *buffer, size_t col)
 {
-        
-        for (size_t i = 0; i < buffer->rows; i++){
-                for (size_t j = col; j < buffer->width[i]-1; j++) {
-                        if (col > buffer->width[i] - 1)
-                                return 0;
-                        csv_copy_field(buffer, i, j, buffer, i, j + 1);
+        size_t columns = 0;
+        for (size_t i = 0; i < buffer->rows; i++)
+                if (buffer->width[i] > columns)
+                        columns = buffer->width[i];
+        if (col >= columns)
+                return 0;
+
+        size_t *keep = buf_malloc(buffer, columns * sizeof(size_t));
+        if (keep == NULL)
+                return 1;
+        for (size_t j = 0; j < columns - 1; j++)
+                keep[j] = j < col ? j : j + 1;
+
+        int status = csv_project_cols(buffer, keep, columns - 1);
+        buf_free(buffer, keep);
+
+        return status == 0 ? 0 : 1;
+}
+
+static size_t project_width(const size_t *keep, size_t n, size_t w,
+                size_t *kept)
+{
+        size_t width = 1, count = 0, same = 0;
+        for (size_t j = 0; j < n; j++) {
+                if (keep[j] < w) {
+                        width = j + 1;
+                        count++;
+                }
+                if (same == j && keep[j] == j)
+                        same++;
+        }
+        *kept = count;
+        return width == w && count == w && same >= w ? 0 : width;
+}
+
+int csv_project_cols(CSV_BUFFER *buffer, const size_t *keep, size_t n)
+{
+        size_t columns = 0;
+        for (size_t i = 0; i < buffer->rows; i++)
+                if (buffer->width[i] > columns)
+                        columns = buffer->width[i];
+
+        /* One scratch block: a copy of a row's pointers, then a mark
+         * per column to catch repeats */
+        CSV_FIELD **old = buf_malloc(buffer, (columns ? columns : 1)
+                        * (sizeof(CSV_FIELD*) + 1));
+        if (old == NULL)
+                return 1;
+        unsigned char *seen = (unsigned char *) (old + columns);
+        memset(seen, 0, columns);
+        for (size_t j = 0; j < n; j++) {
+                if (keep[j] >= columns)
+                        continue;
+                if (seen[keep[j]]) {
+                        buf_free(buffer, old);
+                        return 2;
+                }
+                seen[keep[j]] = 1;
+        }
+        if (to_tree(buffer) != 0) {
+                buf_free(buffer, old);
+                return 1;
+        }
+
+        /* First pass: do everything that can fail, so the second pass
+         * cannot. Rows get room for their new width, and a pool holds
+         * the empty cells that dropped fields cannot make up for. */
+        size_t extra = 0, kept, width;
+        for (size_t i = 0; i < buffer->rows; i++) {
+                size_t w = buffer->width[i];
+                width = project_width(keep, n, w, &kept);
+                if (width == 0)
+                        continue;
+                if (own_row(buffer, i) != 0 || grow_row(buffer, i, width) != 0) {
+                        buf_free(buffer, old);
+                        return 1;
+                }
+                if (width > w)
+                        extra += width - w;
+        }
+
+        CSV_FIELD **pool = buf_malloc(buffer, (extra ? extra : 1) * sizeof(CSV_FIELD*));
+        size_t pooled = 0;
+        while (pool != NULL && pooled < extra) {
+                pool[pooled] = create_field(buffer);
+                if (pool[pooled] == NULL)
+                        break;
+                pooled++;
+        }
+        if (pool == NULL || pooled < extra) {
+                while (pool != NULL && pooled-- > 0)
+                        destroy_field(buffer, pool[pooled]);
+                buf_free(buffer, pool);
+                buf_free(buffer, old);
+                return 1;
+        }
+
+        /* Second pass: move the kept fields into place, then fill the
+         * gaps with dropped fields (cleared) or fields from the pool */
+        for (size_t i = 0; i < buffer->rows; i++) {
+                size_t w = buffer->width[i];
+                CSV_FIELD **row = buffer->field[i];
+                width = project_width(keep, n, w, &kept);
+                if (width == 0)
+                        continue;
+
+                memcpy(old, row, w * sizeof(CSV_FIELD*));
+                for (size_t j = 0; j < width; j++) {
+                        if (j < n && keep[j] < w) {
+                                row[j] = old[keep[j]];
+                                old[keep[j]] = NULL;
+                        }
+                }
+                size_t k = 0;
+                for (size_t j = 0; j < width; j++) {
+                        if (j < n && keep[j] < w)
+                                continue;
+                        while (k < w && old[k] == NULL)
+                                k++;
+                        if (k < w) {
+                                row[j] = old[k];
+                                old[k++] = NULL;
+                                set_field(buffer, row[j], "");
+                        } else {
+                                row[j] = pool[--pooled];
+                        }
+                }
+                for (; k < w; k++)
+                        if (old[k] != NULL)
+                                destroy_field(buffer, old[k]);
+                buffer->width[i] = width;
+        }
+
+        buf_free(buffer, pool);
+        buf_free(buffer, old);
+        return 0;
+}
+
+int csv_reorder_cols(CSV_BUFFER *buffer, const size_t *perm, size_t n)
+{
+        size_t columns = n;
+        for (size_t i = 0; i < buffer->rows; i++)
+                if (buffer->width[i] > columns)
+                        columns = buffer->width[i];
+
+        /* perm, followed by the columns it leaves alone */
+        size_t *keep = buf_malloc(buffer, (columns ? columns : 1) * sizeof(size_t));
+        if (keep == NULL)
+                return 1;
+        memset(keep, 0, n * sizeof(size_t));
+        for (size_t j = 0; j < n; j++) {
+                if (perm[j] >= n || keep[perm[j]]) {
+                        buf_free(buffer, keep);
+                        return 2;
+                }
+                keep[perm[j]] = 1;
+        }
+        for (size_t j = 0; j < columns; j++)
+                keep[j] = j < n ? perm[j] : j;
+
+        int status = csv_project_cols(buffer, keep, columns);
+        buf_free(buffer, keep);
+        return status;
+}
+
+static bool shared_row(CSV_BUFFER *buffer, size_t row)
+{
+        return buffer->share != NULL && buffer->share[row] != NULL
+                && CSV_REF_GET(buffer->share[row]->refs) > 1;
+}
+
+int csv_transpose(CSV_BUFFER *src, CSV_BUFFER *dest, bool take_ownership)
+{
+        bool take = take_ownership || src == dest;
+        if (dest->frozen || (take && src->frozen))
+                return 1;
+        if (src == dest && to_tree(src) != 0)
+                return 1;
+        bool move = take && src->field != NULL && (src == dest
+                || (same_allocator(dest, src) && (!dest->arena || src->arena)));
+
+        size_t rows = src->rows, height = 0;
+        for (size_t i = 0; i < rows; i++)
+                if (src->width[i] > height)
+                        height = src->width[i];
+        size_t *width = buf_malloc(dest, (height ? height : 1) * sizeof(size_t));
+        bool *keep = buf_malloc(dest, (rows ? rows : 1) * sizeof(bool));
+        if (width == NULL || keep == NULL) {
+                buf_free(dest, width);
+                buf_free(dest, keep);
+                return 1;
+        }
+        memset(width, 0, height * sizeof(size_t));
+
+        /* Whether a row's fields move is decided once: releasing one
+         * row can change whether another (sharing its array) looks
+         * shared. Every cell of the result that is not moved, gaps
+         * included, goes into one chunk. */
+        size_t cells = 0, copies = 0, text = 0, length;
+        for (size_t i = 0; i < rows; i++) {
+                keep[i] = move && !shared_row(src, i);
+                for (size_t j = 0; j < src->width[i]; j++) {
+                        width[j] = i + 1;
+                        cells++;
+                        if (keep[i])
+                                continue;
+                        copies++;
+                        cell_text(src, i, j, &length);
+                        if (length > CSV_SMALL_TEXT)
+                                text += length;
+                }
+        }
+        for (size_t j = 0; j < height; j++)
+                copies += width[j];
+        copies -= cells;
+
+        size_t *row_capacity;
+        CSV_FIELD ***field = alloc_rows(dest, height, height, width, &row_capacity);
+        CSV_CHUNK *chunk = NULL;
+        CSV_STORE *store = NULL;
+        if (field != NULL && copies > 0) {
+                size_t size = copies * sizeof(CSV_FIELD) + text + CSV_SMALL_TEXT;
+                chunk = buf_malloc(dest, sizeof(CSV_CHUNK) + size);
+                store = buf_malloc(dest, sizeof(CSV_STORE));
+                if (chunk != NULL) {
+                        chunk->size = size;
+                        chunk->used = size;
+                }
+        }
+        if (field == NULL || (copies > 0 && (chunk == NULL || store == NULL))) {
+                for (size_t j = 0; field != NULL && j < height; j++)
+                        buf_free(dest, field[j]);
+                if (field != NULL) {
+                        buf_free(dest, field);
+                        buf_free(dest, row_capacity);
+                }
+                buf_free(dest, chunk);
+                buf_free(dest, store);
+                buf_free(dest, width);
+                buf_free(dest, keep);
+                return 1;
+        }
+
+        /* Tile by tile, so that the rows of field being written and
+         * the rows of src being read both stay in cache */
+        CSV_FIELD *cell = chunk != NULL ? (CSV_FIELD *) chunk->data : NULL;
+        char *to = (char *) (cell + copies);
+        for (size_t ib = 0; ib < rows; ib += CSV_TRANSPOSE_BLOCK) {
+                size_t iend = rows - ib > CSV_TRANSPOSE_BLOCK ?
+                        ib + CSV_TRANSPOSE_BLOCK : rows;
+                for (size_t jb = 0; jb < height; jb += CSV_TRANSPOSE_BLOCK) {
+                        for (size_t i = ib; i < iend; i++) {
+                                size_t w = src->width[i];
+                                if (w <= jb)
+                                        continue;
+                                size_t jend = w - jb > CSV_TRANSPOSE_BLOCK ?
+                                        jb + CSV_TRANSPOSE_BLOCK : w;
+                                for (size_t j = jb; j < jend; j++) {
+                                        if (keep[i]) {
+                                                field[j][i] = src->field[i][j];
+                                                continue;
+                                        }
+                                        char *from = cell_text(src, i, j, &length);
+                                        memcpy(to, from, length);
+                                        place_text(cell, &to, length);
+                                        field[j][i] = cell++;
+                                }
+                        }
+                }
+        }
+        for (size_t j = 0; j < height; j++) {
+                for (size_t i = 0; i < width[j]; i++) {
+                        if (j < src->width[i])
+                                continue;
+                        cell->small[0] = '\0';
+                        cell->text = cell->small;
+                        cell->length = 1;
+                        cell->flags = CSV_FIELD_BORROWED;
+                        field[j][i] = cell++;
+                }
+        }
+
+        /* Nothing can fail from here on. src lets go of the rows whose
+         * fields moved, but not of the fields themselves. */
+        if (move) {
+                for (size_t i = 0; i < rows; i++) {
+                        if (!keep[i]) {
+                                release_row(src, i);
+                                continue;
+                        }
+                        if (src->share != NULL) {
+                                buf_free(src, src->share[i]);
+                                src->share[i] = NULL;
+                        }
+                        buf_free(src, src->field[i]);
+                        src->field[i] = NULL;
                 }
-                remove_last_field(buffer, i);
+                src->rows = 0;
+        }
+        if (src == dest) {
+                buf_free(dest, dest->field);
+                buf_free(dest, dest->row_capacity);
+                buf_free(dest, dest->share);
+                dest->share = NULL;
+        } else {
+                free_layout(dest);
+                if (move) {
+                        dest->store = src->store;
+                        src->store = NULL;
+                } else if (take) {
+                        free_layout(src);
+                        src->rows = 0;
+                        src->capacity = 0;
+                }
+        }
+
+        buf_free(dest, dest->width);
+        dest->width = width;
+        dest->field = field;
+        dest->row_capacity = row_capacity;
+        dest->rows = height;
+        dest->capacity = height ? height : 1;
+        if (chunk != NULL) {
+                if (dest->store == NULL) {
+                        CSV_REF_INIT(store->refs, 1);
+                        store->chunks = NULL;
+                        store->parent = NULL;
+                        dest->store = store;
+                        store = NULL;
+                }
+                chunk->next = dest->store->chunks;
+                dest->store->chunks = chunk;
+                buf_free(dest, store);
         }
 
+        buf_free(dest, keep);
         return 0;
 }
 
 void csv_set_text_delim(CSV_BUFFER *buffer, char new_delim)
 {
-        buffer->text_delim = new_delim;
+        if (!buffer->frozen)
+                buffer->text_delim = new_delim;
 }
 
 void csv_set_field_delim(CSV_BUFFER *buffer, char new_delim)
 {
-        buffer->field_delim = new_delim;
+        if (!buffer->frozen)
+                buffer->field_delim = new_delim;
 }
 
 int csv_get_height(CSV_BUFFER *buffer)
@@ -894,43 +4326,102 @@ int csv_get_field_length(CSV_BUFFER *buffer, size_t row, size_t entry)
                 return 0;
         else if (entry > buffer->width[row] - 1)
                 return 0;
-        else 
-                return buffer->field[row][entry]->length - 1;
+        else {
+                size_t length;
+                cell_text(buffer, row, entry, &length);
+                return length - 1;
+        }
 }
 
-int csv_set_field(CSV_BUFFER *buffer, size_t row, size_t entry,
-                char *field)
+static CSV_FIELD *field_at(CSV_BUFFER *buffer, size_t row, size_t entry)
 {
 
+        if (to_tree(buffer) != 0)
+                return NULL;
+
+        /* Setting a far cell makes room for it in one step */
+        if (row >= buffer->capacity
+            && grow_rows(buffer, row + 1 > 2 * buffer->capacity ?
+                            row + 1 : 2 * buffer->capacity) != 0)
+                return NULL;
         while (row >= buffer->rows) {
-                append_row(buffer);
+                if (append_row(buffer) != 0)
+                        return NULL;
         }
-        while (entry >= buffer->width[row])
-                append_field(buffer, row);
+        if (entry >= buffer->row_capacity[row]
+            && grow_row(buffer, row, entry + 1 > 2 * buffer->row_capacity[row] ?
+                            entry + 1 : 2 * buffer->row_capacity[row]) != 0)
+                return NULL;
+        while (entry >= buffer->width[row]) {
+                if (append_field(buffer, row) != 0)
+                        return NULL;
+        }
+        if (own_row(buffer, row) != 0)
+                return NULL;
 
-        if (set_field(buffer->field[row][entry], field) == 0)
-                return 0;
-        else 
+        return buffer->field[row][entry];
+}
+
+int csv_set_field(CSV_BUFFER *buffer, size_t row, size_t entry,
+                char *field)
+{
+        CSV_FIELD *cell = field_at(buffer, row, entry);
+
+        if (cell == NULL || set_field(buffer, cell, field) != 0)
+                return 1;
+        return 0;
+}
+
+int csv_set_field_n(CSV_BUFFER *buffer, size_t row, size_t entry,
+                const char *data, size_t length)
+{
+        CSV_FIELD *cell = field_at(buffer, row, entry);
+
+        if (cell == NULL || set_field_n(buffer, cell, data, length) != 0)
+                return 1;
+        return 0;
+}
+
+int csv_set_field_adopt(CSV_BUFFER *buffer, size_t row, size_t entry,
+                char *data, size_t length)
+{
+        CSV_FIELD *cell = field_at(buffer, row, entry);
+
+        if (cell == NULL) {
+                buf_free(buffer, data);
                 return 1;
+        }
+        return adopt_text(buffer, cell, data, length);
 }
 
 int csv_insert_field(CSV_BUFFER *buffer, size_t row, size_t entry,
                 char *field)
 {
         /* If the field does not exist, simply set it */
-        if (row > buffer->rows - 1
-                || entry > buffer->width[row] - 1)
-                csv_set_field(buffer, row, entry, field);
+        if (row >= buffer->rows || entry >= buffer->width[row])
+                return csv_set_field(buffer, row, entry, field);
+        if (to_tree(buffer) != 0 || own_row(buffer, row) != 0)
+                return 1;
 
-        /* Otherwise move everything over, then set it */
-        else {
-                append_field(buffer, row);
-                for (size_t i = buffer->width[row] - 1; i > entry; i--)
-                        csv_copy_field(buffer, row, i,
-                                        buffer, row, i-1);
-                csv_set_field(buffer,row,entry,field);
+        /* Otherwise make the new field, then move everything over */
+        size_t width = buffer->width[row];
+        if (width == buffer->row_capacity[row]
+            && grow_row(buffer, row, width < 2 ? 4 : 2 * width) != 0)
+                return 1;
+        CSV_FIELD *cell = create_field(buffer);
+        if (cell == NULL)
+                return 1;
+        if (set_field(buffer, cell, field) != 0) {
+                destroy_field(buffer, cell);
+                return 1;
         }
 
+        CSV_FIELD **fields = buffer->field[row];
+        memmove(fields + entry + 1, fields + entry,
+                        (width - entry) * sizeof(CSV_FIELD*));
+        fields[entry] = cell;
+        buffer->width[row]++;
+
         return 0;
 }
 
@@ -939,7 +4430,7 @@ void print_csv(CSV_BUFFER *buffer)
         printf("\n");
         for (size_t i = 0; i < buffer->rows; i++) {
                 for (size_t j = 0; j < buffer->width[i]; j++) {
-                        printf("%c%s%c%c", buffer->text_delim, buffer->field[i][j]->text, buffer->text_delim, buffer->field_delim);
+                        printf("%c%s%c%c", buffer->text_delim, cell_text(buffer, i, j, NULL), buffer->text_delim, buffer->field_delim);
                 }
                 printf("\n");
         }
@@ -3,13 +3,75 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 typedef struct CSV_BUFFER CSV_BUFFER;
 
+typedef struct CSV_ALLOCATOR {
+        void *(*malloc)(void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *ptr, size_t size);
+        void (*free)(void *ctx, void *ptr);
+        void *ctx;
+} CSV_ALLOCATOR;
+
+typedef struct CSV_STATS {
+        size_t text;
+        size_t fields;
+        size_t cells;
+        size_t rows;
+        size_t width;
+        size_t overhead;
+        size_t slack;
+        size_t total;
+        size_t shared;
+        size_t allocations;
+} CSV_STATS;
+
 CSV_BUFFER *csv_create_buffer();
+CSV_BUFFER *csv_create_buffer_alloc(const CSV_ALLOCATOR *allocator);
 void csv_destroy_buffer();
+CSV_BUFFER *csv_snapshot(CSV_BUFFER *buffer);
+int csv_begin(CSV_BUFFER *buffer);
+int csv_commit(CSV_BUFFER *buffer);
+int csv_rollback(CSV_BUFFER *buffer);
+void csv_memory_stats(CSV_BUFFER *buffer, CSV_STATS *stats);
+int csv_compact(CSV_BUFFER *buffer, size_t *reclaimed);
+CSV_BUFFER *csv_retain(CSV_BUFFER *buffer);
+int csv_freeze(CSV_BUFFER *buffer);
+int csv_use_arena(CSV_BUFFER *buffer, size_t chunk_size);
+int csv_reserve_rows(CSV_BUFFER *buffer, size_t rows);
+int csv_reserve_fields(CSV_BUFFER *buffer, size_t row, size_t fields);
+
+#define CSV_LAYOUT_TREE 0
+#define CSV_LAYOUT_ROWS 1
+#define CSV_LAYOUT_COLUMNS 2
+
+int csv_set_layout(CSV_BUFFER *buffer, int layout);
+int csv_get_layout(CSV_BUFFER *buffer);
+char *csv_entry(CSV_BUFFER *buffer, size_t row, size_t entry);
+
+#define CSV_NO_CODE UINT32_MAX
+
+uint32_t csv_get_code(CSV_BUFFER *buffer, size_t row, size_t entry);
+uint32_t csv_find_code(CSV_BUFFER *buffer, size_t entry, const char *text);
+size_t csv_get_distinct(CSV_BUFFER *buffer, size_t entry);
+
+typedef struct CSV_VIEW {
+        const char *text;
+        size_t length;
+} CSV_VIEW;
+
+int csv_append_row(CSV_BUFFER *buffer, const CSV_VIEW *fields, size_t n);
+int csv_insert_rows(CSV_BUFFER *buffer, size_t at,
+                CSV_BUFFER *src, size_t src_first, size_t count);
+int csv_splice(CSV_BUFFER *dest, size_t at, CSV_BUFFER *src,
+                bool take_ownership);
+int csv_append_buffer(CSV_BUFFER *dest, CSV_BUFFER *src,
+                bool take_ownership);
 
 int csv_load(CSV_BUFFER *buffer, char *file_name);
+int csv_load_exact(CSV_BUFFER *buffer, char *file_name);
 int csv_save(char *file_name, CSV_BUFFER *buffer);
 
 void csv_set_text_delim(CSV_BUFFER *buffer, char new_delim);
@@ -26,15 +88,33 @@ int csv_copy_row(CSV_BUFFER *dest, int dest_row,
                 CSV_BUFFER *source, int source_row);
 int csv_clear_row(CSV_BUFFER *buffer, size_t row);
 int csv_remove_row(CSV_BUFFER *buffer, size_t row);
+int csv_move_row(CSV_BUFFER *dest, size_t dest_row,
+                CSV_BUFFER *src, size_t src_row);
+int csv_swap_rows(CSV_BUFFER *buffer, size_t a, size_t b);
+int csv_remove_rows_if(CSV_BUFFER *buffer,
+                int (*pred)(CSV_BUFFER *buffer, size_t row, void *user),
+                void *user);
+int csv_remove_rows_mask(CSV_BUFFER *buffer, const unsigned char *mask);
 
 int csv_copy_field(CSV_BUFFER *dest, int dest_row, int dest_entry,
                 CSV_BUFFER *source, int source_row, int source_entry);
 int csv_clear_field(CSV_BUFFER *buffer, size_t row, size_t entry);
 int csv_remove_field(CSV_BUFFER *buffer, size_t row, size_t entry);
+int csv_move_field(CSV_BUFFER *dest, size_t dest_row, size_t dest_entry,
+                CSV_BUFFER *src, size_t src_row, size_t src_entry);
+
+int csv_remove_col(CSV_BUFFER *buffer, size_t col);
+int csv_project_cols(CSV_BUFFER *buffer, const size_t *keep, size_t n);
+int csv_reorder_cols(CSV_BUFFER *buffer, const size_t *perm, size_t n);
+int csv_transpose(CSV_BUFFER *src, CSV_BUFFER *dest, bool take_ownership);
 
 int csv_set_field(CSV_BUFFER *buffer, size_t row, size_t entry,
         char *field);
-int csv_insret_field(CSV_BUFFER *buffer, size_t row, size_t entry,
+int csv_set_field_n(CSV_BUFFER *buffer, size_t row, size_t entry,
+        const char *data, size_t length);
+int csv_set_field_adopt(CSV_BUFFER *buffer, size_t row, size_t entry,
+        char *data, size_t length);
+int csv_insert_field(CSV_BUFFER *buffer, size_t row, size_t entry,
         char *field);
 
 